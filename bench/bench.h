@@ -0,0 +1,103 @@
+// Benchmarks are built with the editor itself compiled in, its main()
+// renamed, so that they time the same code the editor runs.
+#define main hed_main
+#include "../src/main.cpp"
+#undef main
+
+#include <cstdarg>
+
+// init_editor() asks the terminal for its size, so it gets a pseudo
+// terminal as stdout while it runs.
+void bench_init() {
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1) {
+        perror("posix_openpt");
+        exit(1);
+    }
+    int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+    if (slave == -1) {
+        perror("open pty");
+        exit(1);
+    }
+    winsize ws = {};
+    ws.ws_row = 40;
+    ws.ws_col = 120;
+    ioctl(slave, TIOCSWINSZ, &ws);
+
+    fflush(stdout);
+    int out = dup(STDOUT_FILENO);
+    dup2(slave, STDOUT_FILENO);
+    init_editor();
+    dup2(out, STDOUT_FILENO);
+    close(out);
+    close(slave);
+    close(master);
+}
+
+// A log of about `mb` megabytes: timestamped lines of a few kinds, some
+// with tabs, and an "ERR<n> timeout" line every 1000 lines.
+std::string bench_log(usize mb) {
+    static const char* kinds[] = {
+        "INFO  worker-%02u handled request %u in %u ms",
+        "DEBUG cache\thit ratio %u.%02u%% after %u lookups",
+        "WARN  slow query on shard %u took %u ms (limit %u)",
+        "INFO  session %u text_field updated by user_%u",
+    };
+    std::string out;
+    out.reserve(mb << 20);
+    u32 seed = 1;
+    char line[160];
+    for (u64 i = 0; out.size() < (mb << 20); i++) {
+        seed = seed * 1103515245 + 12345;
+        u32 a = seed >> 16 & 0xff, b = seed >> 8 & 0xffff, c = seed & 0x3ff;
+        int n = snprintf(line, sizeof(line), "2024-03-%02u %02u:%02u:%02u.%03u ",
+            (u32)(i / 100000 % 28 + 1), (u32)(i / 3600 % 24), (u32)(i / 60 % 60), (u32)(i % 60), c % 1000);
+        if (i % 1000 == 999) n += snprintf(line + n, sizeof(line) - n, "ERROR ERR%u timeout talking to shard %u", a % 100, b);
+        else n += snprintf(line + n, sizeof(line) - n, kinds[seed >> 29 & 3], a, b, c);
+        line[n++] = '\n';
+        out.append(line, n);
+    }
+    return out;
+}
+
+// Opens `text` as the buffer, fully loaded.
+void bench_open(const std::string& text) {
+    char path[] = "/tmp/hed-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1 || write(fd, text.data(), text.size()) != (isize)text.size()) {
+        perror("bench file");
+        exit(1);
+    }
+    close(fd);
+    open_file(path);
+    E.wait_for_load();
+    unlink(path);
+}
+
+// Best time of `reps` runs of `f`, in seconds.
+template <typename F>
+double bench_best(int reps, F f) {
+    double best = 1e30;
+    for (int i = 0; i < reps; i++) {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+        best = std::min(best, took.count());
+    }
+    return best;
+}
+
+// Times collecting every match of `query` in the buffer, as b, B and
+// :s do, and prints the throughput.
+void bench_search(const char* query, bool icase, bool regex) {
+    SearchPattern pat;
+    std::string error = pat.compile(query, icase, regex);
+    if (error != "") {
+        printf("%s: %s\n", query, error.c_str());
+        exit(1);
+    }
+    std::vector<SearchMatch> found;
+    double s = bench_best(3, [&] { collect_matches(pat, &found); });
+    printf("%-7s %-24s %-6s %9zu matches %8.3f s %6.2f GB/s\n",
+        regex ? "regex" : "literal", query, icase ? "icase" : "", found.size(), s, E.file.size / s / 1e9);
+}
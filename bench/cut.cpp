@@ -0,0 +1,46 @@
+// Times cutting 1M lines out of a 1.2M-line buffer, pasting them back
+// and undoing both, first with the lines still in the file and then
+// with every row materialized. Usage: cut [lines to cut]
+#include "bench.h"
+
+// One pass: the rows a cut and a paste leave behind differ from the
+// ones they started with, so repeating would time something else.
+void bench_cut_round(const char* what, int first, int n) {
+    int rows = E.numrows();
+    // From the middle of one row to the middle of another, so both ends
+    // are partial rows.
+    E.mx = 5;
+    E.my = first;
+    E.set_cpos(5, first + n);
+    double cut = bench_best(1, [] { do_cut_cursor_mark_region(); });
+    if (E.numrows() != rows - n) {
+        printf("cut left %d rows, not %d\n", E.numrows(), rows - n);
+        exit(1);
+    }
+    double paste = bench_best(1, [] { do_paste_from_clipboard(1); });
+    double undo_paste = bench_best(1, [] { do_undo(1); });
+    double undo_cut = bench_best(1, [] { do_undo(1); });
+    if (E.numrows() != rows) {
+        printf("undo left %d rows, not %d\n", E.numrows(), rows);
+        exit(1);
+    }
+    printf("%-13s cut %8.2f ms  paste %8.2f ms  undo paste %8.2f ms  undo cut %8.2f ms\n",
+        what, cut * 1e3, paste * 1e3, undo_paste * 1e3, undo_cut * 1e3);
+}
+
+int main(int argc, char** argv) {
+    int n = argc > 1 ? atoi(argv[1]) : 1000000;
+    int first = n / 10;
+    bench_init();
+    std::string text;
+    for (int i = 0; i < first * 2 + n; i++) {
+        text += fmt::format("line {} of the buffer\tsome text after a tab\n", i);
+    }
+    bench_open(text);
+    printf("%d of %d lines\n", n, E.numrows());
+
+    bench_cut_round("file lines", first, n);
+    for (int i = first; i <= first + n; i++) E.get_row_at(i);
+    bench_cut_round("materialized", first, n);
+    return 0;
+}
@@ -0,0 +1,44 @@
+// Syntax highlighting throughput over a large C++ file, in MB/s. The
+// input is the given file, or the editor's own source, repeated to
+// about MB megabytes. Usage: highlight [MB] [file]
+#include "bench.h"
+
+// Times lexing every line from the top, each in the state the one
+// before it ends in, and prints the throughput. Spans are kept only
+// when `spans` is set, as when rows are drawn.
+void bench_highlight(const char* what, bool spans) {
+    std::vector<HlSpan> out;
+    usize nspans = 0;
+    double s = bench_best(3, [&] {
+        nspans = 0;
+        u32 state = HLS_NORMAL;
+        for (int i = 0; i < E.file.numlines(); i++) {
+            out.clear();
+            state = syntax_highlight(E.file.line(i), state, spans ? &out : NULL);
+            nspans += out.size();
+        }
+    });
+    printf("%-10s %9zu spans %8.3f s %8.1f MB/s\n", what, nspans, s, E.file.size / s / 1e6);
+}
+
+int main(int argc, char** argv) {
+    usize mb = argc > 1 ? atoi(argv[1]) : 64;
+    const char* path = argc > 2 ? argv[2] : "src/main.cpp";
+    std::ifstream in(path, std::ios::binary);
+    std::string source((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (source.empty()) {
+        printf("%s: nothing to read\n", path);
+        return 1;
+    }
+    std::string text;
+    while (text.size() < (mb << 20)) text += source;
+
+    bench_init();
+    bench_open(text);
+    set_path("highlight.cpp");
+    printf("%zu MB, %d lines of %s\n", (usize)(E.file.size >> 20), E.file.numlines(), path);
+
+    bench_highlight("highlight", true);
+    bench_highlight("scan", false);
+    return 0;
+}
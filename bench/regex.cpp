@@ -0,0 +1,25 @@
+// Regex search throughput against the literal path over a generated
+// log, in GB/s. Usage: regex [MB]
+#include "bench.h"
+
+int main(int argc, char** argv) {
+    usize mb = argc > 1 ? atoi(argv[1]) : 128;
+    bench_init();
+    bench_open(bench_log(mb));
+    printf("%zu MB, %d lines, %d threads\n", (usize)(E.file.size >> 20), E.file.numlines(),
+        std::min((int)std::thread::hardware_concurrency(), SEARCH_MAX_THREADS));
+
+    // The same query down both paths.
+    bench_search("NEEDLE", false, false);
+    bench_search("NEEDLE", false, true);
+    bench_search("ERR42 timeout", false, false);
+    bench_search("ERR42 timeout", false, true);
+    // Few bytes can start a match, so the scan skips to them.
+    bench_search("ERR[0-9]+ timeout", false, true);
+    bench_search("limit [0-9]+\\)$", false, true);
+    // Many matches.
+    bench_search("te(xt|st)_field", false, true);
+    // Any letter may start a match, so every byte goes through the DFA.
+    bench_search("[a-z]+_[a-z]+", false, true);
+    return 0;
+}
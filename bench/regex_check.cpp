@@ -0,0 +1,112 @@
+// Checks the regex engine on random patterns and texts: match starts
+// and lengths against std::regex, whose POSIX grammar also takes the
+// longest match, and the start-byte skip against the plain scan.
+// Usage: regex_check [cases]
+#include "bench.h"
+#include <random>
+#include <regex>
+
+std::mt19937 rng(1);
+
+std::string random_regex(const char* letters, int depth) {
+    int k = depth > 3 ? rng() % 4 : rng() % 10;
+    switch (k) {
+        case 0: return std::string(1, letters[rng() % strlen(letters)]);
+        case 1: return "[ab]";
+        case 2: return rng() % 2 ? "." : "[^a]";
+        case 3: return std::string(1, "ab"[rng() % 2]);
+        case 4: return random_regex(letters, depth+1) + random_regex(letters, depth+1);
+        case 5: return "(" + random_regex(letters, depth+1) + "|" + random_regex(letters, depth+1) + ")";
+        case 6: return "(" + random_regex(letters, depth+1) + ")*";
+        case 7: return "(" + random_regex(letters, depth+1) + ")+";
+        case 8: return "(" + random_regex(letters, depth+1) + ")?";
+        default: {
+            int min = rng() % 3, max = min + rng() % 3;
+            return fmt::format("({}){{{},{}}}", random_regex(letters, depth+1), min, max);
+        }
+    }
+}
+
+std::string random_anchors(const std::string& re) {
+    return (rng() % 4 == 0 ? "^" : "") + re + (rng() % 4 == 0 ? "$" : "");
+}
+
+// Longest match of `ref` starting at byte `at` of `line`, 0 if none.
+usize reference_match_len(const std::regex& ref, const std::string& line, usize at) {
+    auto flags = at ? std::regex_constants::match_prev_avail : std::regex_constants::match_default;
+    for (usize len = line.size() - at; len > 0; len--) {
+        auto f = flags;
+        if (at + len < line.size()) f |= std::regex_constants::match_not_eol;
+        if (std::regex_match(line.cbegin() + at, line.cbegin() + at + len, ref, f)) return len;
+    }
+    return 0;
+}
+
+// Starts and lengths of every match against std::regex, on a few short
+// lines of a small alphabet. Returns false on a mismatch.
+bool check_against_std(const std::string& src, bool icase) {
+    SearchPattern pat;
+    if (pat.compile(src, icase, true) != "") return true;
+    auto flags = std::regex::extended;
+    if (icase) flags |= std::regex::icase;
+    std::regex ref(src, flags);
+
+    std::string text;
+    std::vector<usize> want, want_len;
+    int nlines = 1 + rng() % 4;
+    for (int i = 0; i < nlines; i++) {
+        std::string line;
+        int len = rng() % 12;
+        for (int j = 0; j < len; j++) line += "abcAB"[rng() % (icase ? 5 : 3)];
+        for (usize at = 0; at < line.size(); at++) {
+            usize len = reference_match_len(ref, line, at);
+            if (len) {
+                want.push_back(text.size() + at);
+                want_len.push_back(len);
+            }
+        }
+        text += line;
+        if (i+1 < nlines) text += '\n';
+    }
+
+    std::vector<usize> got;
+    regex_find_all(&pat.re, text, &got);
+    bool same = got == want;
+    for (usize i = 0; same && i < got.size(); i++) {
+        same = regex_match_len(&pat.re, text, got[i]) == want_len[i];
+    }
+    if (!same) printf("mismatch with std::regex: '%s'%s on \"%s\"\n", src.c_str(), icase ? " icase" : "", text.c_str());
+    return same;
+}
+
+// Starts found with the start-byte skip against those found without.
+bool check_skip(const std::string& src, bool icase) {
+    SearchPattern pat;
+    if (pat.compile(src, icase, true) != "") return true;
+    std::string text;
+    int len = rng() % 400;
+    for (int j = 0; j < len; j++) text += "abcdefghAB\n x"[rng() % 13];
+
+    std::vector<usize> got, want;
+    regex_find_all(&pat.re, text, &got);
+    Regex plain = pat.re;
+    plain.nskip = -1;
+    regex_find_all(&plain, text, &want);
+    if (got != want) printf("mismatch with skip: '%s'%s on \"%s\"\n", src.c_str(), icase ? " icase" : "", text.c_str());
+    return got == want;
+}
+
+int main(int argc, char** argv) {
+    int cases = argc > 1 ? atoi(argv[1]) : 4000;
+    int bad = 0;
+    for (int i = 0; i < cases; i++) {
+        bool icase = rng() % 3 == 0;
+        if (!check_against_std(random_anchors(random_regex("abc", 0)), icase)) bad++;
+    }
+    for (int i = 0; i < cases * 5; i++) {
+        bool icase = rng() % 3 == 0;
+        if (!check_skip(random_anchors(random_regex("abcdefgh", 0)), icase)) bad++;
+    }
+    printf("%d cases against std::regex, %d against the plain scan, %d bad\n", cases, cases * 5, bad);
+    return bad ? 1 : 0;
+}
@@ -0,0 +1,20 @@
+// Search throughput over a generated log, in GB/s. Usage: search [MB]
+#include "bench.h"
+
+int main(int argc, char** argv) {
+    usize mb = argc > 1 ? atoi(argv[1]) : 128;
+    bench_init();
+    bench_open(bench_log(mb));
+    printf("%zu MB, %d lines, %d threads\n", (usize)(E.file.size >> 20), E.file.numlines(),
+        std::min((int)std::thread::hardware_concurrency(), SEARCH_MAX_THREADS));
+
+    // No match: the first-byte filter alone decides.
+    bench_search("NEEDLE", false, false);
+    bench_search("needle", true, false);
+    // Rare matches.
+    bench_search("ERR42 timeout", false, false);
+    bench_search("err42 TIMEOUT", true, false);
+    // Many matches.
+    bench_search("request", false, false);
+    return 0;
+}
@@ -0,0 +1,83 @@
+// Checks incremental highlighting against lexing the whole buffer from
+// the top, over random edits and jumps of the view. Usage:
+// syntax_check [edits]
+#include "bench.h"
+#include <random>
+
+std::mt19937 rng(1);
+
+// Start and end states of every row, lexed from the top.
+void full_lex(std::vector<u32>* starts, std::vector<u32>* ends) {
+    starts->clear();
+    ends->clear();
+    u32 state = HLS_NORMAL;
+    for (int j = 0; j < E.numrows(); j++) {
+        starts->push_back(state);
+        state = syntax_scan(E.rows.text(j), state);
+        ends->push_back(state);
+    }
+}
+
+// Rows on screen must be highlighted from their true start state, and
+// rows above the frontier, which are trusted, must end in their true
+// end state.
+bool check_rows(int view, int edit) {
+    std::vector<u32> starts, ends;
+    full_lex(&starts, &ends);
+    for (int j = 0; j < E.numrows(); j++) {
+        int off;
+        RowNode* n = E.rows.find(j, &off);
+        if (!n->row || n->row->hl_gen != E.hl_gen) continue;
+        EditorRow* row = n->row;
+        bool shown = j >= view && j < view + E.screenrows;
+        if ((shown && row->hl_start != starts[j]) || (j < E.syn_frontier && row->hl_end != ends[j])) {
+            printf("edit %d, view at %d: row %d %s stores start %u end %u, true start %u end %u\n",
+                edit, view, j, shown ? "on screen" : "trusted", row->hl_start, row->hl_end, starts[j], ends[j]);
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    int edits = argc > 1 ? atoi(argv[1]) : 3000;
+    bench_init();
+    // Fewer rows than HL_SYNC_LINES, so lexing back from any row reaches
+    // the top and the result is exact.
+    std::string text;
+    for (int i = 0; i < HL_SYNC_LINES * 3/4; i++) {
+        text += fmt::format("int v{} = {}; // note {}\n", i, i * 7, i);
+    }
+    bench_open(text);
+    set_path("check.c");
+
+    const char* bits[] = { "/*", "*/", "\"", "'", "//", "\n", "x", " 1.5f ", "\\" };
+    int view = 0;
+    syntax_update_rows(view, view + E.screenrows);
+    for (int i = 0; i < edits; i++) {
+        int y = rng() % E.numrows();
+        int len = E.get_row_at(y)->len();
+        int x = len ? rng() % (len + 1) : 0;
+        bool grow = E.numrows() < 20 || (rng() % 3 && E.numrows() < HL_SYNC_LINES);
+        if (grow) {
+            int endx, endy;
+            insert_text(x, y, bits[rng() % (sizeof(bits) / sizeof(bits[0]))], &endx, &endy);
+        } else if (x < len) {
+            delete_text(x, y, x + 1, y, NULL);
+        } else if (y+1 < E.numrows()) {
+            delete_text(x, y, 0, y+1, NULL);
+        }
+
+        // Look at the edit, or somewhere near it, as scrolling and
+        // jumping around would.
+        int views = 1 + rng() % 3;
+        for (int k = 0; k < views; k++) {
+            int to = y + (int)(rng() % 80) - 40;
+            view = std::max(0, std::min(to, E.numrows() - 1));
+            syntax_update_rows(view, view + E.screenrows);
+            if (!check_rows(view, i)) return 1;
+        }
+    }
+    printf("%d edits, %d rows, no mismatch\n", edits, E.numrows());
+    return 0;
+}
@@ -0,0 +1,105 @@
+// Checks that undo and redo bring back the exact bytes a save writes,
+// through edits that empty the buffer and fill it again. Usage:
+// undo_check [rounds]
+#include "bench.h"
+#include <random>
+
+std::mt19937 rng(1);
+
+// Shows newlines as \n so a state prints on one line.
+std::string shown(const std::string& s) {
+    std::string r;
+    for (char c : s) r += c == '\n' ? std::string("\\n") : std::string(1, c);
+    return r;
+}
+
+// Runs one command the way a key press does.
+template <typename F>
+void key(F f) {
+    undo_seal();
+    f();
+    do_after_action();
+}
+
+void random_cursor() {
+    if (E.numrows() == 0) {
+        E.set_cpos(0, 0);
+        return;
+    }
+    int y = rng() % E.numrows();
+    E.set_cpos(rng() % (E.get_row_at(y)->len() + 1), y);
+}
+
+// Makes random edits from `start`, keeping what a save would write after
+// each, then undoes them all and redoes them all. Every state passed on
+// the way must be one of those, in order.
+bool check_round(const std::string& start, int round) {
+    bench_open(start);
+    E.set_cpos(0, 0);
+    std::vector<std::string> states = { rows_to_string() };
+    int nedits = 1 + rng() % 12;
+    for (int i = 0; i < nedits; i++) {
+        switch (rng() % 6) {
+            case 0: case 1: key([] { do_insert_char("ab\n"[rng() % 3]); }); break;
+            case 2: key([] { do_delete_left_char(); }); break;
+            case 3: key([] { do_delete_current_char(); }); break;
+            case 4: key([] {
+                random_cursor();
+                do_set_mark();
+                random_cursor();
+                do_cut_cursor_mark_region();
+            }); break;
+            case 5: key([] { do_paste_from_clipboard(1); }); break;
+        }
+        if (rows_to_string() != states.back()) states.push_back(rows_to_string());
+        if (rng() % 3 == 0) random_cursor();
+    }
+
+    auto fail = [&](const char* what) {
+        printf("round %d from \"%s\": %s reached \"%s\"; states were:", round, shown(start).c_str(), what, shown(rows_to_string()).c_str());
+        for (auto& s : states) printf(" \"%s\"", shown(s).c_str());
+        printf("\n");
+        return false;
+    };
+    usize k = states.size() - 1;
+    undo_end_typing();
+    while (E.undo.done) {
+        key([] { do_undo(1); });
+        while (k > 0 && states[k] != rows_to_string()) k--;
+        if (states[k] != rows_to_string()) return fail("undo");
+    }
+    if (k != 0) return fail("undoing everything");
+    while (E.undo.done < E.undo.steps.size()) {
+        key([] { do_redo(1); });
+        while (k+1 < states.size() && states[k] != rows_to_string()) k++;
+        if (states[k] != rows_to_string()) return fail("redo");
+    }
+    if (k != states.size() - 1) return fail("redoing everything");
+    return true;
+}
+
+// A file of one empty line, Enter, undo: what is saved must again be
+// that one empty line.
+bool check_enter() {
+    bench_open("\n");
+    E.set_cpos(0, 0);
+    key([] { do_insert_newline(false); });
+    key([] { do_undo(1); });
+    if (rows_to_string() != "\n") {
+        printf("undoing Enter on an empty line reached \"%s\"\n", shown(rows_to_string()).c_str());
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 20000;
+    bench_init();
+    const char* starts[] = { "", "\n", "a\n", "ab\n\n", "a" };
+    int bad = !check_enter();
+    for (int i = 0; i < rounds && bad < 5; i++) {
+        if (!check_round(starts[rng() % 5], i)) bad++;
+    }
+    printf("%d rounds, %d bad\n", rounds, bad);
+    return bad ? 1 : 0;
+}
@@ -4,13 +4,32 @@
 #include <cstdlib>
 #include <ctype.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <cerrno>
 #include <cstdint>
+#include <cstring>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <fstream>
 #include <cassert>
 #include <ctime>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <new>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <deque>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HED_X86
+#endif
 
 #include <fmt/format.h>
 
@@ -26,7 +45,29 @@ typedef int32_t i32;
 typedef int64_t i64;
 typedef ssize_t isize;
 
+// Heap allocations made by the current thread. refresh_screen() uses
+// it to report how many allocations a frame took.
+thread_local u64 heap_allocs = 0;
+
+// These are kept out of line: once inlined, GCC pairs the malloc()
+// and free() inside with the other operator and warns of a mismatch.
+__attribute__((noinline)) void* operator new(usize size) {
+    heap_allocs++;
+    void* p = malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, usize) noexcept {
+    free(p);
+}
+
 const int TAB_STOP = 4;
+const int COUNT_MAX = 99999999;
 const int NUM_FORCE_QUIT_PRESS = 2;
 
 enum EditorMode {
@@ -77,23 +118,93 @@ enum EditorKey {
     ALT_ARROW_DOWN,
 
     UNKNOWN_KEY = -1,
+    NO_KEY = -2,
+};
+
+enum EditorHighlight {
+    HL_NORMAL = 0,
+    HL_NUMBER,
+    HL_STRING,
+    HL_COMMENT,
+    HL_KEYWORD,
+    HL_TYPE,
+    HL_CONST,
+    HL_COUNT,
 };
 
 #define EDSYN_HLT_NUMBER (1<<0)
 #define EDSYN_HLT_STRING (1<<1)
+#define EDSYN_HLT_RAW_STRING (1<<2)
+
+struct SynWord {
+    std::string_view word;
+    u8 kind;
+};
+
+const usize SYN_TABLE_SIZE = 256;
+
+constexpr u32 syn_word_hash(std::string_view word, u32 seed) {
+    u32 h = seed;
+    for (char c : word) h = (h ^ (u8)c) * 16777619u;
+    return h ^ (h >> 15);
+}
+
+// Perfect hash table over the keywords, types and constants of a
+// syntax. The seed is searched for at compile time so that every word
+// gets a slot of its own, which makes classifying a word a single probe.
+struct SynWordTable {
+    SynWord slots[SYN_TABLE_SIZE];
+    u32 seed;
+    usize minlen;
+    usize maxlen;
+
+    constexpr EditorHighlight find(std::string_view word) const {
+        if (word.size() < minlen || word.size() > maxlen) return HL_NORMAL;
+        const SynWord& s = slots[syn_word_hash(word, seed) % SYN_TABLE_SIZE];
+        return s.word == word ? (EditorHighlight)s.kind : HL_NORMAL;
+    }
+};
+
+template<usize NK, usize NT, usize NC>
+constexpr SynWordTable make_syn_word_table(
+        const std::string_view (&keywords)[NK],
+        const std::string_view (&types)[NT],
+        const std::string_view (&consts)[NC]) {
+    SynWord words[NK+NT+NC] = {};
+    usize n = 0;
+    for (usize i = 0; i < NK; i++) words[n++] = {keywords[i], HL_KEYWORD};
+    for (usize i = 0; i < NT; i++) words[n++] = {types[i], HL_TYPE};
+    for (usize i = 0; i < NC; i++) words[n++] = {consts[i], HL_CONST};
+
+    for (u32 seed = 1;; seed++) {
+        SynWordTable t = {};
+        t.seed = seed;
+        t.minlen = words[0].word.size();
+        t.maxlen = words[0].word.size();
+        bool ok = true;
+        for (usize i = 0; i < n && ok; i++) {
+            SynWord& slot = t.slots[syn_word_hash(words[i].word, seed) % SYN_TABLE_SIZE];
+            if (slot.word.size() && slot.word != words[i].word) ok = false;
+            slot = words[i];
+            if (words[i].word.size() < t.minlen) t.minlen = words[i].word.size();
+            if (words[i].word.size() > t.maxlen) t.maxlen = words[i].word.size();
+        }
+        if (ok) return t;
+    }
+}
 
 struct EditorSyntax {
-    std::string filetype;
-    std::string* extmatch;
-    std::string* keywords;
-    std::string* types;
-    std::string* consts;
-    std::string singleline_comment_start;
+    std::string_view filetype;
+    const std::string_view* extmatch;
+    const SynWordTable* words;
+    std::string_view singleline_comment_start;
+    std::string_view multiline_comment_start;
+    std::string_view multiline_comment_end;
     int flags;
 };
 
-std::string C_EXTS[] = {"c", "h", "cpp", ""};
-std::string C_KEYWORDS[] = {
+constexpr std::string_view C_EXTS[] = {"c", "h", "cpp", ""};
+constexpr std::string_view C_KEYWORDS[] = {
     "switch",
     "if",
     "while",
@@ -117,7 +228,6 @@ std::string C_KEYWORDS[] = {
     "constexpr",
     "template",
     "typename",
-    "const",
     "#include",
     "#pragma",
     "#define",
@@ -126,9 +236,8 @@ std::string C_KEYWORDS[] = {
     "#ifndef",
     "#elif",
     "#endif",
-    "",
 };
-std::string C_TYPES[] = {
+constexpr std::string_view C_TYPES[] = {
     "void",
     "char",
     "bool",
@@ -140,92 +249,2074 @@ std::string C_TYPES[] = {
     "long",
     "float",
     "double",
-    "",
 };
-std::string C_CONSTS[] = {
+constexpr std::string_view C_CONSTS[] = {
     "true",
     "false",
     "NULL",
-    "",
 };
+constexpr SynWordTable C_WORDS = make_syn_word_table(C_KEYWORDS, C_TYPES, C_CONSTS);
 
-EditorSyntax HLDB[] = {
+constexpr EditorSyntax HLDB[] = {
     {
         "c",
         C_EXTS,
-        C_KEYWORDS,
-        C_TYPES,
-        C_CONSTS,
+        &C_WORDS,
         "//",
-        EDSYN_HLT_NUMBER | EDSYN_HLT_STRING
+        "/*",
+        "*/",
+        EDSYN_HLT_NUMBER | EDSYN_HLT_STRING | EDSYN_HLT_RAW_STRING
     },
 };
 #define NUM_HLDBS (sizeof(HLDB) / sizeof(HLDB[0]))
 
-enum EditorHighlight {
-    HL_NORMAL = 0,
-    HL_NUMBER,
-    HL_STRING,
-    HL_COMMENT,
-    HL_KEYWORD,
-    HL_TYPE,
-    HL_CONST,
+constexpr int hl_to_color(EditorHighlight hl) {
+    switch (hl) {
+        case HL_NUMBER: return 31;
+        case HL_STRING: return 35;
+        case HL_COMMENT: return 35;
+        case HL_KEYWORD: return 32;
+        case HL_TYPE: return 33;
+        case HL_CONST: return 35;
+        default: return 37;
+    }
+}
+
+// A face is what a screen cell is drawn with. Faces below HL_COUNT are
+// the EditorHighlight values themselves. FACE_MATCH can be or'ed into
+// those and into FACE_CONTROL to put the search match background
+// behind them.
+enum Face {
+    FACE_CONTROL = HL_COUNT,
+    FACE_STATUS_INSERT,
+    FACE_STATUS_NORMAL,
+    FACE_ERROR,
+    FACE_COUNT,
+};
+#define FACE_MATCH 0x80
+
+struct SgrCode {
+    char seq[15];
+    u8 len;
+};
+
+constexpr void sgr_push_param(SgrCode* code, int param) {
+    code->seq[code->len++] = ';';
+    if (param >= 10) code->seq[code->len++] = '0' + param / 10;
+    code->seq[code->len++] = '0' + param % 10;
+}
+
+// Builds "\x1b[0;...m": a full reset followed by the given attributes,
+// so the sequence does not depend on what the terminal had before.
+constexpr SgrCode make_sgr(int fg, int bg, bool bold, bool reverse) {
+    SgrCode code = {};
+    code.seq[code.len++] = '\x1b';
+    code.seq[code.len++] = '[';
+    code.seq[code.len++] = '0';
+    if (bold) sgr_push_param(&code, 1);
+    if (reverse) sgr_push_param(&code, 7);
+    if (fg) sgr_push_param(&code, fg);
+    if (bg) sgr_push_param(&code, bg);
+    code.seq[code.len++] = 'm';
+    return code;
+}
+
+constexpr SgrCode face_sgr(int face) {
+    int bg = (face & FACE_MATCH) ? 44 : 0;
+    switch (face & ~FACE_MATCH) {
+        case HL_NORMAL: return make_sgr(0, bg, false, false);
+        case FACE_CONTROL: return make_sgr(0, bg, false, true);
+        case FACE_STATUS_INSERT: return make_sgr(30, 47, true, false);
+        case FACE_STATUS_NORMAL: return make_sgr(30, 44, true, false);
+        case FACE_ERROR: return make_sgr(37, 41, false, false);
+        default:
+            return make_sgr(
+                hl_to_color((EditorHighlight)(face & ~FACE_MATCH)),
+                bg,
+                false,
+                false);
+    }
+}
+
+struct SgrTable {
+    SgrCode codes[256];
+};
+
+constexpr SgrTable make_sgr_table() {
+    SgrTable table = {};
+    for (int face = 0; face < FACE_COUNT; face++) {
+        table.codes[face] = face_sgr(face);
+        table.codes[face | FACE_MATCH] = face_sgr(face | FACE_MATCH);
+    }
+    return table;
+}
+
+// Pre-encoded SGR sequence of every face, indexed by the face.
+constexpr SgrTable SGR_TABLE = make_sgr_table();
+
+enum SyntaxState {
+    HLS_NORMAL = 0,
+    HLS_COMMENT,
+    HLS_RAW_STRING,
+};
+
+// The lexer state carried from one row into the next is a SyntaxState
+// in the low byte and, inside a raw string, an index into
+// raw_string_ends above it.
+#define HLS_KIND(s) ((s) & 0xff)
+#define HLS_RAW_END(s) ((s) >> 8)
+
+// How far back to look for a row whose lexer state is known before
+// giving up and assuming a normal state there.
+const int HL_SYNC_LINES = 300;
+
+// Rows longer than this are highlighted in chunks of about this many
+// bytes, so that an edit only re-lexes the chunks around it.
+const u32 HL_CHUNK = 4 * 1024;
+
+enum CmdlineStyle {
+    NONE,
+    ERROR,
+};
+
+struct PoolStats {
+    u64 allocs;
+    u64 live;
+    u64 slabs;
+    u64 slab_bytes;
+};
+
+const usize POOL_SLAB_SIZE = 64*1024;
+
+// Hands out fixed-size blocks carved from POOL_SLAB_SIZE slabs. Freed
+// blocks go on a free list for reuse, and release() gives every slab
+// back at once without visiting the blocks.
+struct Pool {
+    usize objsize;
+    usize align;
+    std::vector<char*> slabs;
+    char* cur;
+    char* end;
+    void* freelist;
+    PoolStats stats;
+
+    void init(usize size, usize align = alignof(std::max_align_t)) {
+        this->align = align;
+        objsize = std::max(size, sizeof(void*));
+        objsize = (objsize + align-1) & ~(align-1);
+        cur = NULL;
+        end = NULL;
+        freelist = NULL;
+        stats = {};
+    }
+
+    void* alloc() {
+        stats.allocs++;
+        stats.live++;
+        if (freelist) {
+            void* p = freelist;
+            freelist = *(void**)p;
+            return p;
+        }
+        if (cur == end) {
+            usize size = std::max(POOL_SLAB_SIZE, objsize);
+            cur = (char*)malloc(size);
+            if (!cur) throw std::bad_alloc();
+            end = cur + size / objsize * objsize;
+            slabs.push_back(cur);
+            stats.slabs++;
+            stats.slab_bytes += size;
+        }
+        void* p = cur;
+        cur += objsize;
+        return p;
+    }
+
+    void free(void* p) {
+        stats.live--;
+        *(void**)p = freelist;
+        freelist = p;
+    }
+
+    void release() {
+        for (char* slab : slabs) ::free(slab);
+        slabs.clear();
+        init(objsize, align);
+    }
+};
+
+template<typename T>
+T* pool_new(Pool* pool) {
+    return new (pool->alloc()) T();
+}
+
+template<typename T>
+void pool_delete(Pool* pool, T* p) {
+    p->~T();
+    pool->free(p);
+}
+
+const int BYTE_ARENA_CLASSES = 9;
+const usize BYTE_ARENA_MAX = 16 << (BYTE_ARENA_CLASSES-1);
+
+// Byte buffers rounded up to a power of two from 16 to BYTE_ARENA_MAX,
+// each size served by its own Pool; larger ones come from malloc.
+struct ByteArena {
+    Pool classes[BYTE_ARENA_CLASSES];
+    u64 large_live;
+    u64 large_bytes;
+
+    void init() {
+        for (int i = 0; i < BYTE_ARENA_CLASSES; i++) classes[i].init(16 << i);
+        large_live = 0;
+        large_bytes = 0;
+    }
+
+    static int class_of(usize cap) {
+        int c = 0;
+        while ((usize)(16 << c) < cap) c++;
+        return c;
+    }
+
+    // Usable size of a buffer allocated for `size` bytes. Callers keep
+    // the requested size rather than the capacity and pass it back to
+    // free.
+    static usize capacity(usize size) {
+        return (size > BYTE_ARENA_MAX) ? size : (usize)16 << class_of(size);
+    }
+
+    u8* alloc(usize size) {
+        if (size > BYTE_ARENA_MAX) {
+            large_live++;
+            large_bytes += size;
+            u8* p = (u8*)malloc(size);
+            if (!p) throw std::bad_alloc();
+            return p;
+        }
+        return (u8*)classes[class_of(size)].alloc();
+    }
+
+    void free(u8* p, usize size) {
+        if (!p) return;
+        if (size > BYTE_ARENA_MAX) {
+            large_live--;
+            large_bytes -= size;
+            ::free(p);
+            return;
+        }
+        classes[class_of(size)].free(p);
+    }
+
+    // Returns a buffer for `size` bytes in place of `p`, which held
+    // `old`; keeps `p` when both round to the same capacity. Contents
+    // are not carried over.
+    u8* reuse(u8* p, usize old, usize size) {
+        if (p && size && capacity(size) == capacity(old)) return p;
+        free(p, old);
+        return size ? alloc(size) : NULL;
+    }
+
+    void release() {
+        for (int i = 0; i < BYTE_ARENA_CLASSES; i++) classes[i].release();
+    }
+};
+
+// A run of `len` bytes starting at `start` in one highlight class.
+// Bytes outside every span are HL_NORMAL.
+struct HlSpan {
+    u32 start;
+    u32 len : 24;
+    u32 hl : 8;
+};
+
+const u32 HL_SPAN_MAX_LEN = (1 << 24) - 1;
+
+// A point between two tokens of a line and what the lexer knew there.
+// `state` is what carries over from the previous line at the start and
+// into the next one at the end; between tokens it is always normal.
+struct LexPoint {
+    u32 pos;
+    u32 state;
+    bool prev_sep;
+    bool prev_number;
+
+    bool same_as(const LexPoint& o) const {
+        return pos == o.pos && state == o.state && prev_sep == o.prev_sep && prev_number == o.prev_number;
+    }
+};
+
+// Highlighting of one piece of a long row: lexed from `from`, with
+// spans relative to `from.pos`. It is only current while `gen` matches
+// E.hl_gen; an edit inside the chunk clears it.
+struct HlChunk {
+    LexPoint from;
+    u32 gen;
+    HlSpan* hl;
+    u32 nhl;
+};
+
+// A tab at byte `pos` of a row, drawn starting at screen column `col`.
+struct TabStop {
+    u32 pos;
+    u32 col;
+
+    // Screen column just past the tab.
+    u32 end_col() const {
+        return col + TAB_STOP - (col % TAB_STOP);
+    }
+};
+
+// Bytes [start, end) of a row that are under a search match.
+struct MatchSpan {
+    u32 start;
+    u32 end;
+};
+
+struct RowNode;
+
+struct EditorRow {
+    // While a row is unmodified its bytes are read straight out of
+    // the original file block; the first edit copies them into `data`.
+    const char* src;
+    int srclen;
+    bool owned;
+    std::string data;
+    // The row's tabs in order, with the screen column each starts at.
+    // Columns are worked out from these instead of keeping a
+    // tab-expanded copy of the text.
+    TabStop* tabs;
+    u32 ntabs;
+    // Rows longer than HL_CHUNK keep their highlighting here, a chunk
+    // at a time, instead of in `hl`.
+    u32 nchunks;
+    HlChunk* chunks;
+    // Highlight spans in order of position. A tab's class applies to
+    // all the columns it covers.
+    HlSpan* hl;
+    u32 nhl;
+    // Lexer states the row was highlighted from and ended in. `hl` is
+    // only current while `hl_gen` matches E.hl_gen.
+    u32 hl_start;
+    u32 hl_end;
+    u32 hl_gen;
+    // Matches of the highlighted search in order. They are only current
+    // while `found_gen` matches E.search_hl.gen.
+    MatchSpan* found;
+    u32 nfound;
+    u32 found_gen;
+    RowNode* node;
+
+    int len() {
+        return owned ? (int)data.size() : srclen;
+    }
+
+    std::string_view text() {
+        if (owned) return std::string_view(data);
+        return std::string_view(src, srclen);
+    }
+
+    std::string& own() {
+        if (!owned) {
+            data.assign(src, srclen);
+            owned = true;
+        }
+        return data;
+    }
+};
+
+const usize LINE_INDEX_BLOCK = 64;
+
+// Line offsets stored as a u64 base for every LINE_INDEX_BLOCK lines
+// plus a u32 delta per line, about half the size of plain offsets.
+// A line starting 4 GiB or more past its block's base (a few huge
+// lines) gets LINE_INDEX_WIDE as its delta and its full offset in
+// `wide`, which stays sorted by line since lines are only appended.
+const u32 LINE_INDEX_WIDE = UINT32_MAX;
+
+struct LineIndex {
+    std::vector<u64> bases;
+    std::vector<u32> deltas;
+    std::vector<std::pair<usize, u64>> wide;
+
+    usize size() {
+        return deltas.size();
+    }
+
+    bool empty() {
+        return deltas.empty();
+    }
+
+    void clear() {
+        bases.clear();
+        deltas.clear();
+        wide.clear();
+    }
+
+    u64 operator[](usize i) {
+        u32 delta = deltas[i];
+        if (delta != LINE_INDEX_WIDE) return bases[i / LINE_INDEX_BLOCK] + delta;
+        auto it = std::lower_bound(wide.begin(), wide.end(), std::make_pair(i, (u64)0));
+        assert(it != wide.end() && it->first == i);
+        return it->second;
+    }
+
+    void push_back(u64 off) {
+        if (deltas.size() % LINE_INDEX_BLOCK == 0) bases.push_back(off);
+        u64 delta = off - bases.back();
+        if (delta >= LINE_INDEX_WIDE) {
+            wide.push_back({deltas.size(), off});
+            delta = LINE_INDEX_WIDE;
+        }
+        deltas.push_back((u32)delta);
+    }
+
+    void append(const std::vector<u64>& offs) {
+        deltas.reserve(deltas.size() + offs.size());
+        for (u64 off : offs) push_back(off);
+    }
+};
+
+// Original file content. It is mapped read-only once on open and never
+// written to; `linestarts[i]` is the offset of line i, and one extra
+// entry marks the end of the last line.
+struct FileBlock {
+    const char* data;
+    usize size;
+    bool mapped;
+    LineIndex linestarts;
+
+    int numlines() {
+        return linestarts.empty() ? 0 : (int)linestarts.size()-1;
+    }
+
+    std::string_view line(int i) {
+        u64 start = linestarts[i];
+        return std::string_view(data + start, linestarts[i+1]-1 - start);
+    }
+
+    // Bytes of lines [first, first+n) including their newlines, minus
+    // the one the last line of the file may be missing.
+    std::string_view lines_span(int first, int n) {
+        u64 start = linestarts[first];
+        u64 end = linestarts[first+n];
+        if (end > size) end = size;
+        return std::string_view(data + start, end - start);
+    }
+
+    // Line in [lo, hi) that holds the byte at `off`.
+    int line_at(u64 off, int lo, int hi) {
+        while (hi - lo > 1) {
+            int mid = lo + (hi - lo) / 2;
+            if (linestarts[mid] <= off) lo = mid;
+            else hi = mid;
+        }
+        return lo;
+    }
+
+    // Like line_at, for a byte expected to be a few lines past line
+    // `from`: the range is doubled until it holds the byte.
+    int line_after(u64 off, int from) {
+        int n = numlines();
+        int step = 1;
+        while (from + step < n && linestarts[from + step] <= off) {
+            from += step;
+            step *= 2;
+        }
+        return line_at(off, from, std::min(from + step, n));
+    }
+};
+
+// Rows are kept in an implicit treap ordered by row index. A node is
+// either one materialized row or a run of consecutive lines still
+// sitting untouched in the file block. Runs are cut lazily the first
+// time one of their rows is asked for, so every edit is O(log n).
+struct RowNode {
+    RowNode* left;
+    RowNode* right;
+    RowNode* parent;
+    u32 prio;
+    int count;
+    int first;
+    int nlines;
+    EditorRow* row;
+};
+
+// Row headers, tree nodes, highlight buffers and tab indexes of the
+// open buffer.
+Pool row_pool;
+Pool node_pool;
+ByteArena hl_arena;
+ByteArena tab_arena;
+
+void update_row_render(EditorRow* row);
+
+int node_count(RowNode* n) {
+    return n ? n->count : 0;
+}
+
+void node_update(RowNode* n) {
+    n->count = node_count(n->left) + n->nlines + node_count(n->right);
+    if (n->left) n->left->parent = n;
+    if (n->right) n->right->parent = n;
+}
+
+u32 node_rand() {
+    static u32 state = 2463534242u;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+RowNode* new_node(EditorRow* row, int first, int nlines) {
+    RowNode* n = pool_new<RowNode>(&node_pool);
+    n->left = NULL;
+    n->right = NULL;
+    n->parent = NULL;
+    n->prio = node_rand();
+    n->first = first;
+    n->nlines = nlines;
+    n->row = row;
+    if (row) row->node = n;
+    node_update(n);
+    return n;
+}
+
+RowNode* node_merge(RowNode* a, RowNode* b) {
+    if (!a) return b;
+    if (!b) return a;
+    if (a->prio > b->prio) {
+        a->right = node_merge(a->right, b);
+        node_update(a);
+        return a;
+    }
+    b->left = node_merge(a, b->left);
+    node_update(b);
+    return b;
+}
+
+// Puts the first `k` rows of `n` in `l` and the rest in `r`, cutting
+// a run in two if it straddles the split point.
+void node_split(RowNode* n, int k, RowNode** l, RowNode** r) {
+    if (!n) {
+        *l = NULL;
+        *r = NULL;
+        return;
+    }
+    int lcount = node_count(n->left);
+    if (k <= lcount) {
+        node_split(n->left, k, l, &n->left);
+        node_update(n);
+        *r = n;
+    } else if (k >= lcount + n->nlines) {
+        node_split(n->right, k - lcount - n->nlines, &n->right, r);
+        node_update(n);
+        *l = n;
+    } else {
+        int head = k - lcount;
+        RowNode* tail = new_node(NULL, n->first + head, n->nlines - head);
+        n->nlines = head;
+        *r = node_merge(tail, n->right);
+        n->right = NULL;
+        node_update(n);
+        *l = n;
+    }
+}
+
+void node_fix_counts(RowNode* n) {
+    if (!n) return;
+    node_fix_counts(n->left);
+    node_fix_counts(n->right);
+    node_update(n);
+}
+
+// Builds a treap holding `nodes` in order in O(n): each node goes onto
+// the right spine, taking the lower-priority tail of the spine as its
+// left subtree.
+RowNode* node_build(const std::vector<RowNode*>& nodes) {
+    std::vector<RowNode*> spine;
+    for (RowNode* n : nodes) {
+        RowNode* last = NULL;
+        while (!spine.empty() && spine.back()->prio < n->prio) {
+            last = spine.back();
+            spine.pop_back();
+        }
+        n->left = last;
+        if (!spine.empty()) spine.back()->right = n;
+        spine.push_back(n);
+    }
+    if (spine.empty()) return NULL;
+    node_fix_counts(spine[0]);
+    return spine[0];
+}
+
+template<typename F>
+void node_each(RowNode* n, int* idx, F& fn) {
+    if (!n) return;
+    node_each(n->left, idx, fn);
+    fn(n, *idx);
+    *idx += n->nlines;
+    node_each(n->right, idx, fn);
+}
+
+struct RowTree {
+    RowNode* root;
+    FileBlock* file;
+
+    int size() {
+        return node_count(root);
+    }
+
+    void set_root(RowNode* n) {
+        root = n;
+        if (root) root->parent = NULL;
+    }
+
+    // Like get, but never materializes: returns the node holding row
+    // `at` and the row's offset inside it.
+    RowNode* find(int at, int* off) {
+        RowNode* n = root;
+        while (n) {
+            int lcount = node_count(n->left);
+            if (at < lcount) {
+                n = n->left;
+            } else if (at < lcount + n->nlines) {
+                *off = at - lcount;
+                return n;
+            } else {
+                at -= lcount + n->nlines;
+                n = n->right;
+            }
+        }
+        return NULL;
+    }
+
+    EditorRow* get(int at) {
+        int idx = at;
+        RowNode* n = root;
+        while (n) {
+            int lcount = node_count(n->left);
+            if (at < lcount) {
+                n = n->left;
+            } else if (at < lcount + n->nlines) {
+                if (n->row) return n->row;
+                break;
+            } else {
+                at -= lcount + n->nlines;
+                n = n->right;
+            }
+        }
+        return materialize(idx);
+    }
+
+    // Text of row `at`, read from the file when the row has not been
+    // materialized yet.
+    std::string_view text(int at) {
+        int off;
+        RowNode* n = find(at, &off);
+        if (n->row) return n->row->text();
+        return file->line(n->first + off);
+    }
+
+    EditorRow* materialize(int at) {
+        RowNode *l, *m, *r;
+        node_split(root, at, &l, &m);
+        node_split(m, 1, &m, &r);
+
+        std::string_view line = file->line(m->first);
+        EditorRow* row = pool_new<EditorRow>(&row_pool);
+        row->src = line.data();
+        row->srclen = (int)line.size();
+        row->owned = false;
+        row->tabs = NULL;
+        row->ntabs = 0;
+        row->hl = NULL;
+        row->nhl = 0;
+        row->chunks = NULL;
+        row->nchunks = 0;
+        row->found = NULL;
+        row->nfound = 0;
+        row->found_gen = 0;
+        m->row = row;
+        row->node = m;
+        update_row_render(row);
+
+        set_root(node_merge(node_merge(l, m), r));
+        return row;
+    }
+
+    void insert(int at, EditorRow* row) {
+        RowNode *l, *r;
+        node_split(root, at, &l, &r);
+        set_root(node_merge(node_merge(l, new_node(row, 0, 1)), r));
+    }
+
+    // Inserts `nodes` before row `at` with a single split and merge.
+    void insert_nodes(int at, const std::vector<RowNode*>& nodes) {
+        RowNode *l, *r;
+        node_split(root, at, &l, &r);
+        set_root(node_merge(node_merge(l, node_build(nodes)), r));
+    }
+
+    // Likewise for materialized rows.
+    void insert_many(int at, const std::vector<EditorRow*>& rows) {
+        std::vector<RowNode*> nodes;
+        nodes.reserve(rows.size());
+        for (EditorRow* row : rows) nodes.push_back(new_node(row, 0, 1));
+        insert_nodes(at, nodes);
+    }
+
+    void append_run(int first, int nlines) {
+        set_root(node_merge(root, new_node(NULL, first, nlines)));
+    }
+
+    // Unlinks row `at` and returns its node; the caller frees it.
+    RowNode* remove(int at) {
+        RowNode *l, *m, *r;
+        node_split(root, at, &l, &m);
+        node_split(m, 1, &m, &r);
+        set_root(node_merge(l, r));
+        return m;
+    }
+
+    // Unlinks rows [at, at+n) and returns them as one subtree; the
+    // caller frees it.
+    RowNode* remove_range(int at, int n) {
+        RowNode *l, *m, *r;
+        node_split(root, at, &l, &m);
+        node_split(m, n, &m, &r);
+        set_root(node_merge(l, r));
+        return m;
+    }
+
+    template<typename F>
+    void each(F fn) {
+        int idx = 0;
+        node_each(root, &idx, fn);
+    }
+};
+
+// Each byte scanner appends the offset just past every `c` in
+// [from, to) of `data`.
+void find_bytes_scalar(const char* data, u64 from, u64 to, char c, std::vector<u64>* out) {
+    const char* p = data + from;
+    const char* end = data + to;
+    while (p < end) {
+        const char* hit = (const char*)memchr(p, c, end-p);
+        if (!hit) break;
+        p = hit+1;
+        out->push_back(p - data);
+    }
+}
+
+#ifdef HED_X86
+void find_bytes_sse2(const char* data, u64 from, u64 to, char c, std::vector<u64>* out) {
+    const __m128i needle = _mm_set1_epi8(c);
+    u64 i = from;
+    for (; i + 16 <= to; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+        u32 mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+        while (mask) {
+            out->push_back(i + __builtin_ctz(mask) + 1);
+            mask &= mask-1;
+        }
+    }
+    find_bytes_scalar(data, i, to, c, out);
+}
+
+__attribute__((target("avx2")))
+void find_bytes_avx2(const char* data, u64 from, u64 to, char c, std::vector<u64>* out) {
+    const __m256i needle = _mm256_set1_epi8(c);
+    u64 i = from;
+    for (; i + 64 <= to; i += 64) {
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(data + i)), needle);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(data + i + 32)), needle);
+        u64 mask = (u32)_mm256_movemask_epi8(a) | ((u64)(u32)_mm256_movemask_epi8(b) << 32);
+        while (mask) {
+            out->push_back(i + __builtin_ctzll(mask) + 1);
+            mask &= mask-1;
+        }
+    }
+    find_bytes_sse2(data, i, to, c, out);
+}
+#endif
+
+void find_bytes(const char* data, u64 from, u64 to, char c, std::vector<u64>* out) {
+#ifdef HED_X86
+    static bool has_avx2 = __builtin_cpu_supports("avx2");
+    if (has_avx2) find_bytes_avx2(data, from, to, c, out);
+    else find_bytes_sse2(data, from, to, c, out);
+#else
+    find_bytes_scalar(data, from, to, c, out);
+#endif
+}
+
+void find_newlines(const char* data, u64 from, u64 to, std::vector<u64>* out) {
+    find_bytes(data, from, to, '\n', out);
+}
+
+// Classes of bytes that cursor motions skip over.
+enum ByteClass {
+    BYTE_ALPHA,
+    BYTE_BLANK,
 };
 
-int hl_to_color(EditorHighlight hl) {
-    switch (hl) {
-        case HL_NUMBER: return 31;
-        case HL_STRING: return 35;
-        case HL_COMMENT: return 35;
-        case HL_KEYWORD: return 32;
-        case HL_TYPE: return 33;
-        case HL_CONST: return 35;
-        default: return 37;
+bool byte_in_class(u8 c, ByteClass cls) {
+    if (cls == BYTE_ALPHA) return (u8)((c | 0x20) - 'a') < 26;
+    return c == ' ' || c == '\t';
+}
+
+#ifdef HED_X86
+// Bit i is set when byte i of `v` is in `cls`.
+u32 class_mask_sse2(__m128i v, ByteClass cls) {
+    if (cls == BYTE_ALPHA) {
+        __m128i x = _mm_sub_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(25)), x));
+    }
+    __m128i space = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+    __m128i tab = _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'));
+    return _mm_movemask_epi8(_mm_or_si128(space, tab));
+}
+#endif
+
+// Skips the run of bytes from `from` that are in `cls` when `in` is
+// set, or not in it otherwise, and returns where the run ends.
+usize skip_class(std::string_view text, usize from, ByteClass cls, bool in) {
+    usize i = from;
+#ifdef HED_X86
+    u32 run = in ? 0xffff : 0;
+    for (; i + 16 <= text.size(); i += 16) {
+        u32 stop = class_mask_sse2(_mm_loadu_si128((const __m128i*)(text.data() + i)), cls) ^ run;
+        if (stop) return i + __builtin_ctz(stop);
+    }
+#endif
+    while (i < text.size() && byte_in_class(text[i], cls) == in) i++;
+    return i;
+}
+
+// Like skip_class(), but for the run that ends just before `to`;
+// returns where it starts.
+usize skip_class_back(std::string_view text, usize to, ByteClass cls, bool in) {
+    usize i = to;
+#ifdef HED_X86
+    u32 run = in ? 0xffff : 0;
+    for (; i >= 16; i -= 16) {
+        u32 stop = class_mask_sse2(_mm_loadu_si128((const __m128i*)(text.data() + i-16)), cls) ^ run;
+        if (stop) return i-16 + (32 - __builtin_clz(stop));
+    }
+#endif
+    while (i > 0 && byte_in_class(text[i-1], cls) == in) i--;
+    return i;
+}
+
+// Position of the last byte before `to` that is one of the `n` bytes
+// in `set`, or npos.
+usize rfind_bytes(const u8* data, usize to, const u8* set, int n) {
+    usize i = to;
+#ifdef HED_X86
+    for (; i >= 16; i -= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(data + i-16));
+        __m128i eq = _mm_setzero_si128();
+        for (int k = 0; k < n; k++) eq = _mm_or_si128(eq, _mm_cmpeq_epi8(v, _mm_set1_epi8(set[k])));
+        u32 mask = _mm_movemask_epi8(eq);
+        if (mask) return i-16 + (31 - __builtin_clz(mask));
+    }
+#endif
+    while (i > 0) {
+        i--;
+        for (int k = 0; k < n; k++) {
+            if (data[i] == set[k]) return i;
+        }
+    }
+    return std::string::npos;
+}
+
+u8 fold_case(u8 c) {
+    return (u8)(c - 'A') < 26 ? c | 0x20 : c;
+}
+
+// A set of byte values, one bit each.
+struct ByteSet {
+    u64 bits[4];
+
+    void clear() {
+        memset(bits, 0, sizeof(bits));
+    }
+
+    void add(u8 c) {
+        bits[c >> 6] |= (u64)1 << (c & 63);
+    }
+
+    void add_range(u8 lo, u8 hi) {
+        for (int c = lo; c <= hi; c++) add(c);
+    }
+
+    void add_set(const ByteSet& o) {
+        for (int i = 0; i < 4; i++) bits[i] |= o.bits[i];
+    }
+
+    void invert() {
+        for (int i = 0; i < 4; i++) bits[i] = ~bits[i];
+    }
+
+    bool has(u8 c) const {
+        return (bits[c >> 6] >> (c & 63)) & 1;
+    }
+};
+
+enum RegexOp {
+    RX_SET,
+    RX_CAT,
+    RX_ALT,
+    RX_REPEAT,
+};
+
+// Parsed pattern. `max` is -1 for an unbounded repeat.
+struct RegexNode {
+    RegexOp op;
+    int set;
+    int min, max;
+    std::vector<int> kids;
+};
+
+enum RegexInstOp {
+    RI_SET,
+    RI_SPLIT,
+    RI_MATCH,
+};
+
+// Thompson NFA. RI_SET consumes a byte of `set` and goes to `out`;
+// RI_SPLIT goes to both `out` and `out1` without consuming.
+struct RegexInst {
+    RegexInstOp op;
+    int set;
+    int out, out1;
+};
+
+struct RegexProg {
+    std::vector<RegexInst> insts;
+    int start;
+};
+
+const int REGEX_MAX_REPEAT = 1000;
+const int REGEX_MAX_INSTS = 20000;
+const int REGEX_MAX_DFA_STATES = 2048;
+const int REGEX_MAX_SKIP_BYTES = 4;
+
+enum RegexDfaFlags {
+    DFA_ACCEPT = 1,
+    DFA_DEAD = 2,
+};
+
+// A DFA built lazily from a RegexProg, one state per set of NFA
+// states. With `unanchored` set, a match may start at every byte, so
+// the start state is added back after each step. The cache is thrown
+// away when it reaches REGEX_MAX_DFA_STATES, so memory stays bounded
+// and every byte still costs at most one subset construction. State 0
+// is the start state, and a newline leads back to it from any state.
+struct RegexDfa {
+    bool unanchored;
+    std::vector<std::vector<int>> nfa;
+    std::vector<u8> flags;
+    std::vector<int> next;
+    std::map<std::vector<int>, int> ids;
+    std::vector<u32> seen;
+    u32 stamp;
+};
+
+// A compiled regular expression. Atoms never match a newline, so a
+// match stays within one line; `^` and `$` are only anchors at the very
+// start and end of the pattern. Starts of matches are found by running
+// the reversed pattern backward over the text, and the length of a
+// match by running the pattern forward from its start, so the time is
+// linear in the text.
+struct Regex {
+    std::vector<RegexNode> nodes;
+    std::vector<ByteSet> sets;
+    int root;
+    bool bol, eol;
+    u8 classes[256];
+    int nclasses;
+    RegexProg fwd, rev;
+    RegexDfa starts, ends;
+    // The bytes that lead out of the start state of `starts`, when
+    // there are at most REGEX_MAX_SKIP_BYTES of them; nskip is -1
+    // otherwise.
+    u8 skip[REGEX_MAX_SKIP_BYTES];
+    int nskip;
+};
+
+struct RegexParser {
+    Regex* re;
+    const char* p;
+    const char* end;
+    bool icase;
+    std::string error;
+
+    int node(RegexOp op) {
+        re->nodes.push_back(RegexNode{op, -1, 0, 0, {}});
+        return (int)re->nodes.size()-1;
+    }
+
+    // Lets a letter in `set` match in either case when case is ignored.
+    void fold(ByteSet* set) {
+        if (!icase) return;
+        for (int c = 'a'; c <= 'z'; c++) {
+            if (set->has(c) || set->has(c ^ 0x20)) {
+                set->add(c);
+                set->add(c ^ 0x20);
+            }
+        }
+    }
+
+    int set_node(const ByteSet& set) {
+        re->sets.push_back(set);
+        int n = node(RX_SET);
+        re->nodes[n].set = (int)re->sets.size()-1;
+        return n;
+    }
+
+    // Adds the class of `\c` to `set`; returns false if `c` names none.
+    bool escape_class(char c, ByteSet* set) {
+        ByteSet s;
+        s.clear();
+        switch (c) {
+            case 'd': case 'D': s.add_range('0', '9'); break;
+            case 'w': case 'W': s.add_range('a', 'z'); s.add_range('A', 'Z'); s.add_range('0', '9'); s.add('_'); break;
+            case 's': case 'S': s.add(' '); s.add('\t'); s.add('\r'); s.add('\f'); s.add('\v'); break;
+            default: return false;
+        }
+        if (c >= 'A' && c <= 'Z') s.invert();
+        set->add_set(s);
+        return true;
+    }
+
+    u8 escape_byte(char c) {
+        switch (c) {
+            case 't': return '\t';
+            case 'r': return '\r';
+            case 'f': return '\f';
+            case 'v': return '\v';
+            default: return c;
+        }
+    }
+
+    int parse_class() {
+        ByteSet set;
+        set.clear();
+        bool negate = p < end && *p == '^';
+        if (negate) p++;
+        bool first = true;
+        while (p < end && (*p != ']' || first)) {
+            first = false;
+            u8 lo = *p++;
+            if (lo == '\\' && p < end) {
+                if (escape_class(*p, &set)) {
+                    p++;
+                    continue;
+                }
+                lo = escape_byte(*p++);
+            }
+            u8 hi = lo;
+            if (p+1 < end && *p == '-' && p[1] != ']') {
+                p++;
+                hi = *p++;
+                if (hi == '\\' && p < end) hi = escape_byte(*p++);
+                if (hi < lo) {
+                    error = "bad range in []";
+                    return -1;
+                }
+            }
+            set.add_range(lo, hi);
+        }
+        if (p == end) {
+            error = "missing ]";
+            return -1;
+        }
+        p++;
+        fold(&set);
+        if (negate) set.invert();
+        return set_node(set);
+    }
+
+    int parse_atom() {
+        ByteSet set;
+        set.clear();
+        char c = *p++;
+        switch (c) {
+            case '(': {
+                int n = parse_alt();
+                if (n < 0) return -1;
+                if (p == end || *p != ')') {
+                    error = "missing )";
+                    return -1;
+                }
+                p++;
+                return n;
+            }
+            case '[': return parse_class();
+            case '.': {
+                set.invert();
+                return set_node(set);
+            }
+            case '*': case '+': case '?': {
+                error = "nothing to repeat";
+                return -1;
+            }
+            case '\\': {
+                if (p == end) {
+                    error = "trailing \\";
+                    return -1;
+                }
+                c = *p++;
+                if (!escape_class(c, &set)) set.add(escape_byte(c));
+                fold(&set);
+                return set_node(set);
+            }
+            default: {
+                set.add(c);
+                fold(&set);
+                return set_node(set);
+            }
+        }
+    }
+
+    // Reads `{n}`, `{n,}` or `{n,m}`; anything else leaves `p` alone
+    // and the brace is taken literally.
+    bool parse_bounds(int* min, int* max) {
+        const char* q = p+1;
+        auto number = [&](int* out) {
+            const char* from = q;
+            *out = 0;
+            while (q < end && *q >= '0' && *q <= '9' && *out <= REGEX_MAX_REPEAT) *out = *out*10 + (*q++ - '0');
+            return q > from;
+        };
+        if (!number(min)) return false;
+        *max = *min;
+        if (q < end && *q == ',') {
+            q++;
+            if (!number(max)) *max = -1;
+        }
+        if (q == end || *q != '}') return false;
+        p = q+1;
+        return true;
+    }
+
+    int parse_repeat() {
+        int n = parse_atom();
+        while (n >= 0 && p < end) {
+            int min, max;
+            if (*p == '*') { min = 0; max = -1; p++; }
+            else if (*p == '+') { min = 1; max = -1; p++; }
+            else if (*p == '?') { min = 0; max = 1; p++; }
+            else if (*p == '{' && parse_bounds(&min, &max)) {
+                if (min > REGEX_MAX_REPEAT || max > REGEX_MAX_REPEAT || (max >= 0 && max < min)) {
+                    error = "bad repeat count";
+                    return -1;
+                }
+            }
+            else break;
+            int r = node(RX_REPEAT);
+            re->nodes[r].min = min;
+            re->nodes[r].max = max;
+            re->nodes[r].kids.push_back(n);
+            n = r;
+        }
+        return n;
+    }
+
+    int parse_cat() {
+        int n = node(RX_CAT);
+        while (p < end && *p != '|' && *p != ')') {
+            int kid = parse_repeat();
+            if (kid < 0) return -1;
+            re->nodes[n].kids.push_back(kid);
+        }
+        return n;
+    }
+
+    int parse_alt() {
+        int n = parse_cat();
+        if (n < 0 || p == end || *p != '|') return n;
+        int alt = node(RX_ALT);
+        re->nodes[alt].kids.push_back(n);
+        while (p < end && *p == '|') {
+            p++;
+            n = parse_cat();
+            if (n < 0) return -1;
+            re->nodes[alt].kids.push_back(n);
+        }
+        return alt;
+    }
+};
+
+int regex_inst(RegexProg* prog, RegexInstOp op, int set, int out, int out1) {
+    prog->insts.push_back(RegexInst{op, set, out, out1});
+    return (int)prog->insts.size()-1;
+}
+
+// Emits node `n` so that it continues at `next`, and returns where it
+// starts. With `reversed` set, concatenations are emitted back to
+// front, which gives the program for the reversed pattern.
+int regex_emit(Regex* re, RegexProg* prog, int n, int next, bool reversed) {
+    if ((int)prog->insts.size() > REGEX_MAX_INSTS) return next;
+    const RegexNode& node = re->nodes[n];
+    switch (node.op) {
+        case RX_SET: return regex_inst(prog, RI_SET, node.set, next, -1);
+        case RX_CAT: {
+            int k = (int)node.kids.size();
+            for (int i = 0; i < k; i++) next = regex_emit(re, prog, node.kids[reversed ? i : k-1-i], next, reversed);
+            return next;
+        }
+        case RX_ALT: {
+            int start = regex_emit(re, prog, node.kids.back(), next, reversed);
+            for (int i = (int)node.kids.size()-2; i >= 0; i--) {
+                start = regex_inst(prog, RI_SPLIT, -1, regex_emit(re, prog, node.kids[i], next, reversed), start);
+            }
+            return start;
+        }
+        case RX_REPEAT: {
+            int kid = node.kids[0];
+            if (node.max < 0) {
+                int loop = regex_inst(prog, RI_SPLIT, -1, -1, next);
+                prog->insts[loop].out = regex_emit(re, prog, kid, loop, reversed);
+                next = loop;
+            } else {
+                for (int i = node.min; i < node.max; i++) {
+                    next = regex_inst(prog, RI_SPLIT, -1, regex_emit(re, prog, kid, next, reversed), next);
+                }
+            }
+            for (int i = 0; i < node.min; i++) next = regex_emit(re, prog, kid, next, reversed);
+            return next;
+        }
+    }
+    return next;
+}
+
+// Adds the NFA states reachable from `from` without consuming a byte.
+void regex_closure(const RegexProg& prog, RegexDfa* dfa, int from, std::vector<int>* out) {
+    std::vector<int> todo = {from};
+    while (!todo.empty()) {
+        int i = todo.back();
+        todo.pop_back();
+        if (dfa->seen[i] == dfa->stamp) continue;
+        dfa->seen[i] = dfa->stamp;
+        const RegexInst& inst = prog.insts[i];
+        if (inst.op == RI_SPLIT) {
+            todo.push_back(inst.out1);
+            todo.push_back(inst.out);
+        } else {
+            out->push_back(i);
+        }
+    }
+}
+
+int regex_dfa_state(const Regex& re, const RegexProg& prog, RegexDfa* dfa, std::vector<int>& set) {
+    std::sort(set.begin(), set.end());
+    auto it = dfa->ids.find(set);
+    if (it != dfa->ids.end()) return it->second;
+
+    int id = (int)dfa->nfa.size();
+    u8 flags = set.empty() ? DFA_DEAD : 0;
+    for (int i : set) {
+        if (prog.insts[i].op == RI_MATCH) flags |= DFA_ACCEPT;
+    }
+    dfa->ids[set] = id;
+    dfa->nfa.push_back(set);
+    dfa->flags.push_back(flags);
+    dfa->next.resize(dfa->next.size() + re.nclasses, -1);
+    dfa->next[id * re.nclasses + re.classes['\n']] = 0;
+    return id;
+}
+
+// Empties the cache; state 0 is always the start state.
+void regex_dfa_reset(const Regex& re, const RegexProg& prog, RegexDfa* dfa, bool unanchored) {
+    dfa->unanchored = unanchored;
+    dfa->nfa.clear();
+    dfa->flags.clear();
+    dfa->next.clear();
+    dfa->ids.clear();
+    dfa->seen.assign(prog.insts.size(), 0);
+    dfa->stamp = 1;
+    std::vector<int> set;
+    regex_closure(prog, dfa, prog.start, &set);
+    regex_dfa_state(re, prog, dfa, set);
+}
+
+int regex_dfa_step(const Regex& re, const RegexProg& prog, RegexDfa* dfa, int state, u8 c) {
+    int* slot = &dfa->next[state * re.nclasses + re.classes[c]];
+    if (*slot >= 0) return *slot;
+
+    dfa->stamp++;
+    std::vector<int> set;
+    for (int i : dfa->nfa[state]) {
+        const RegexInst& inst = prog.insts[i];
+        if (inst.op == RI_SET && re.sets[inst.set].has(c)) regex_closure(prog, dfa, inst.out, &set);
+    }
+    if (dfa->unanchored) regex_closure(prog, dfa, prog.start, &set);
+
+    if ((int)dfa->nfa.size() >= REGEX_MAX_DFA_STATES) {
+        regex_dfa_reset(re, prog, dfa, dfa->unanchored);
+        return regex_dfa_state(re, prog, dfa, set);
+    }
+    int next = regex_dfa_state(re, prog, dfa, set);
+    dfa->next[state * re.nclasses + re.classes[c]] = next;
+    return next;
+}
+
+// Bytes that every set treats alike share a class, which keeps the DFA
+// tables small. A newline always gets a class of its own.
+void regex_byte_classes(Regex* re) {
+    std::map<std::vector<bool>, int> ids;
+    for (int c = 0; c < 256; c++) {
+        std::vector<bool> key;
+        key.push_back(c == '\n');
+        for (const ByteSet& s : re->sets) key.push_back(s.has(c));
+        auto it = ids.find(key);
+        if (it == ids.end()) it = ids.emplace(key, (int)ids.size()).first;
+        re->classes[c] = it->second;
+    }
+    re->nclasses = (int)ids.size();
+}
+
+// Compiles `src`; returns an error message, or "" on success.
+std::string regex_compile(Regex* re, std::string_view src, bool icase) {
+    re->nodes.clear();
+    re->sets.clear();
+    re->bol = !src.empty() && src.front() == '^';
+    if (re->bol) src.remove_prefix(1);
+    usize slashes = 0;
+    while (slashes+1 < src.size() && src[src.size()-2-slashes] == '\\') slashes++;
+    re->eol = !src.empty() && src.back() == '$' && slashes % 2 == 0;
+    if (re->eol) src.remove_suffix(1);
+
+    RegexParser parser = {re, src.data(), src.data() + src.size(), icase, ""};
+    re->root = parser.parse_alt();
+    if (re->root >= 0 && parser.p != parser.end) parser.error = "unmatched )";
+    if (!parser.error.empty()) return parser.error;
+
+    // No set matches a newline, so no match crosses a line.
+    for (ByteSet& s : re->sets) s.bits['\n' >> 6] &= ~((u64)1 << ('\n' & 63));
+    regex_byte_classes(re);
+
+    RegexProg* progs[2] = {&re->fwd, &re->rev};
+    for (int k = 0; k < 2; k++) {
+        RegexProg* prog = progs[k];
+        prog->insts.clear();
+        int match = regex_inst(prog, RI_MATCH, -1, -1, -1);
+        prog->start = regex_emit(re, prog, re->root, match, k == 1);
+        if ((int)prog->insts.size() > REGEX_MAX_INSTS) return "pattern too large";
+    }
+
+    regex_dfa_reset(*re, re->rev, &re->starts, !re->eol);
+    regex_dfa_reset(*re, re->fwd, &re->ends, false);
+    if (re->starts.flags[0] & DFA_ACCEPT) return "pattern matches empty text";
+
+    re->nskip = 0;
+    for (int c = 0; c < 256 && re->nskip >= 0; c++) {
+        if (c == '\n' || regex_dfa_step(*re, re->rev, &re->starts, 0, c) == 0) continue;
+        if (re->nskip == REGEX_MAX_SKIP_BYTES) re->nskip = -1;
+        else re->skip[re->nskip++] = c;
+    }
+    return "";
+}
+
+// Appends the start of every match in `text`, in order. The reversed
+// pattern is run from the end of the text to its start, restarting at
+// each newline, and a match starts wherever it accepts.
+void regex_find_all(Regex* re, std::string_view text, std::vector<usize>* out) {
+    usize first = out->size();
+    const u8* data = (const u8*)text.data();
+    RegexDfa* dfa = &re->starts;
+    const int* table = dfa->next.data();
+    const u8* flags = dfa->flags.data();
+    int n = re->nclasses;
+    int state = 0;
+    for (usize p = text.size(); p-- > 0;) {
+        // Nothing but a few bytes leaves the start state: find the
+        // next of them at once.
+        if (state == 0 && re->nskip >= 0) {
+            p = rfind_bytes(data, p+1, re->skip, re->nskip);
+            if (p == std::string::npos) break;
+        }
+        int next = table[state * n + re->classes[data[p]]];
+        if (next < 0) {
+            next = regex_dfa_step(*re, re->rev, dfa, state, data[p]);
+            table = dfa->next.data();
+            flags = dfa->flags.data();
+        }
+        state = next;
+        if (!flags[state]) continue;
+
+        if ((flags[state] & DFA_ACCEPT) && (!re->bol || p == 0 || data[p-1] == '\n')) out->push_back(p);
+        // Anchored at the line end and dead: skip to the line start.
+        if (flags[state] & DFA_DEAD) {
+            const u8* nl = (const u8*)memrchr(data, '\n', p);
+            if (!nl) break;
+            p = nl - data;
+            state = 0;
+        }
+    }
+    std::reverse(out->begin() + first, out->end());
+}
+
+// Length of the longest match starting at `at` of `line`.
+usize regex_match_len(Regex* re, std::string_view line, usize at) {
+    usize len = 0;
+    int state = 0;
+    for (usize p = at; p < line.size() && line[p] != '\n'; p++) {
+        state = regex_dfa_step(*re, re->fwd, &re->ends, state, line[p]);
+        if (re->ends.flags[state] & DFA_DEAD) break;
+        if (re->ends.flags[state] & DFA_ACCEPT) len = p+1 - at;
+    }
+    if (re->eol) {
+        usize eol = line.find('\n', at);
+        len = (eol == std::string_view::npos ? line.size() : eol) - at;
+    }
+    return len;
+}
+
+// A search query, literal or a regular expression. For a literal,
+// candidates are found by comparing the first
+// and last byte of the needle at every position, 16 or 32 at a time,
+// and only those are compared in full. When case is ignored the needle
+// is stored lowered and letters are compared with bit 0x20 forced on.
+struct SearchPattern {
+    std::string needle;
+    bool icase;
+    bool regex;
+    Regex re;
+    u8 first, last;
+    u8 fold_first, fold_last;
+
+    // Returns an error message, or "" on success.
+    std::string compile(std::string_view query, bool ignore_case, bool as_regex) {
+        icase = ignore_case;
+        regex = as_regex;
+        if (regex) return regex_compile(&re, query, icase);
+        needle.assign(query.data(), query.size());
+        if (icase) {
+            for (char& c : needle) c = fold_case(c);
+        }
+        first = needle.front();
+        last = needle.back();
+        fold_first = (icase && (u8)(first - 'a') < 26) ? 0x20 : 0;
+        fold_last = (icase && (u8)(last - 'a') < 26) ? 0x20 : 0;
+        return "";
+    }
+
+    bool matches_at(const char* p) const {
+        if (!icase) return memcmp(p, needle.data(), needle.size()) == 0;
+        for (usize i = 0; i < needle.size(); i++) {
+            if (fold_case(p[i]) != (u8)needle[i]) return false;
+        }
+        return true;
+    }
+
+    bool candidate_at(const char* p) const {
+        return (u8)(p[0] | fold_first) == first && (u8)(p[needle.size()-1] | fold_last) == last;
+    }
+};
+
+// Each pattern scanner returns the first match starting in [from, to]
+// of `text`, or npos; `to` leaves room for the whole needle.
+usize find_pattern_scalar(const SearchPattern& pat, const char* text, usize from, usize to) {
+    for (usize i = from; i <= to; i++) {
+        if (!pat.fold_first) {
+            const char* hit = (const char*)memchr(text + i, pat.first, to+1 - i);
+            if (!hit) break;
+            i = hit - text;
+        }
+        if (pat.candidate_at(text + i) && pat.matches_at(text + i)) return i;
+    }
+    return std::string::npos;
+}
+
+#ifdef HED_X86
+u32 candidate_mask_sse2(const SearchPattern& pat, const char* p) {
+    __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i*)p), _mm_set1_epi8(pat.fold_first));
+    __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i*)(p + pat.needle.size()-1)), _mm_set1_epi8(pat.fold_last));
+    __m128i eq = _mm_and_si128(_mm_cmpeq_epi8(a, _mm_set1_epi8(pat.first)), _mm_cmpeq_epi8(b, _mm_set1_epi8(pat.last)));
+    return _mm_movemask_epi8(eq);
+}
+
+usize find_pattern_sse2(const SearchPattern& pat, const char* text, usize from, usize to) {
+    usize i = from;
+    for (; i + 16 <= to+1; i += 16) {
+        u32 mask = candidate_mask_sse2(pat, text + i);
+        while (mask) {
+            usize at = i + __builtin_ctz(mask);
+            if (pat.matches_at(text + at)) return at;
+            mask &= mask-1;
+        }
+    }
+    return find_pattern_scalar(pat, text, i, to);
+}
+
+__attribute__((target("avx2")))
+usize find_pattern_avx2(const SearchPattern& pat, const char* text, usize from, usize to) {
+    const __m256i first = _mm256_set1_epi8(pat.first);
+    const __m256i last = _mm256_set1_epi8(pat.last);
+    const __m256i fold_first = _mm256_set1_epi8(pat.fold_first);
+    const __m256i fold_last = _mm256_set1_epi8(pat.fold_last);
+    usize i = from;
+    for (; i + 32 <= to+1; i += 32) {
+        __m256i a = _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(text + i)), fold_first);
+        __m256i b = _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(text + i + pat.needle.size()-1)), fold_last);
+        u32 mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        while (mask) {
+            usize at = i + __builtin_ctz(mask);
+            if (pat.matches_at(text + at)) return at;
+            mask &= mask-1;
+        }
+    }
+    return find_pattern_sse2(pat, text, i, to);
+}
+#endif
+
+// First match in `text` starting at or after `from`.
+usize find_pattern(const SearchPattern& pat, std::string_view text, usize from) {
+    usize m = pat.needle.size();
+    if (text.size() < m || from > text.size() - m) return std::string::npos;
+    usize to = text.size() - m;
+#ifdef HED_X86
+    static bool has_avx2 = __builtin_cpu_supports("avx2");
+    if (has_avx2) return find_pattern_avx2(pat, text.data(), from, to);
+    return find_pattern_sse2(pat, text.data(), from, to);
+#else
+    return find_pattern_scalar(pat, text.data(), from, to);
+#endif
+}
+
+// Position of a match; matches compare in buffer order.
+struct SearchMatch {
+    int row;
+    u32 col;
+
+    bool operator<(const SearchMatch& o) const {
+        return row < o.row || (row == o.row && col < o.col);
+    }
+};
+
+// Every match of a query in the buffer, sorted. It stays valid until
+// the text changes, which `text_gen` tells.
+struct SearchMatches {
+    std::string query;
+    SearchPattern pat;
+    u64 text_gen;
+    std::vector<SearchMatch> list;
+};
+
+// A stretch of the buffer searched as a unit: one materialized row, or
+// consecutive lines of the file starting at `line`.
+struct SearchSpan {
+    int row;
+    int line;
+    std::string_view text;
+};
+
+void search_batch(SearchPattern* pat, const std::vector<SearchSpan>& spans, const std::vector<usize>& batches, usize b, std::vector<SearchMatch>* out);
+
+// Searches for the query being typed on a background thread, so that
+// a keystroke never waits for the whole buffer to be searched. Each
+// new query stops the one before. Batches are searched from the one
+// holding the cursor to the end and then from the top; the first match
+// past the cursor is handed over as soon as it is found, and the whole
+// list once the last batch is done. The buffer does not change while
+// a search runs: it is stopped before leaving SEARCH mode, and lines the
+// loader finds meanwhile wait for it to end. A search started while the
+// file is loading covers the rows read so far and is `partial`.
+struct IncrementalSearch {
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::atomic<bool> stopping;
+    bool active;
+    bool shown;
+    std::string query;
+    SearchPattern pat;
+    SearchMatch cursor;
+    std::vector<SearchSpan> spans;
+    std::vector<usize> batches;
+    usize start_batch;
+    std::vector<std::vector<SearchMatch>> found;
+    bool partial;
+    // Handed over under `mutex`.
+    bool has_first;
+    SearchMatch first;
+    bool done;
+
+    void hand_over(const SearchMatch* m) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (m) {
+            has_first = true;
+            first = *m;
+        } else {
+            done = true;
+        }
+        cond.notify_all();
+    }
+
+    static void run(IncrementalSearch* s) {
+        usize n = s->found.size();
+        bool has_first = false;
+        for (usize k = 0; k < n && !s->stopping; k++) {
+            usize b = (s->start_batch + k) % n;
+            search_batch(&s->pat, s->spans, s->batches, b, &s->found[b]);
+            for (const SearchMatch& m : s->found[b]) {
+                if (has_first) break;
+                if (k == 0 && !(s->cursor < m)) continue;
+                s->hand_over(&m);
+                has_first = true;
+            }
+        }
+        // Only matches before the cursor in its own batch are left.
+        if (!has_first && !s->stopping && n && !s->found[s->start_batch].empty()) {
+            s->hand_over(&s->found[s->start_batch][0]);
+        }
+        s->hand_over(NULL);
+    }
+
+    // Waits up to `ms` milliseconds for the first match or the end.
+    void wait(int ms) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait_for(lock, std::chrono::milliseconds(ms), [this] { return has_first || done; });
+    }
+
+    void stop() {
+        if (!active) return;
+        stopping = true;
+        thread.join();
+        active = false;
+    }
+};
+
+// The search whose matches are drawn highlighted. Rows find their
+// matches of it again only when `gen` moves on or their text changes.
+struct SearchHighlight {
+    bool on;
+    std::string query;
+    SearchPattern pat;
+    u32 gen;
+};
+
+// Part of a clip: lines [first, first+nlines) of the file block, each
+// with its newline, or when `nlines` is 0, `text` followed by a newline
+// if `newline` is set.
+struct ClipPiece {
+    int first;
+    int nlines;
+    std::string text;
+    bool newline;
+};
+
+// Text cut out of the buffer, kept for pasting and for undo. Lines
+// still untouched in the file block are held by reference and rows
+// give up their strings to it, so cutting copies almost nothing, and
+// pasting puts the referenced lines back as runs. A clip never changes
+// once made and goes when the last reference to it does.
+struct Clip {
+    u32 refs;
+    std::vector<ClipPiece> pieces;
+    u64 size;
+    // Bytes held in the pieces' own strings.
+    u64 owned;
+    // Newlines in the text and bytes after the last one.
+    int nl;
+    int lastlen;
+};
+
+Clip* new_clip() {
+    Clip* clip = new Clip();
+    clip->refs = 1;
+    clip->size = 0;
+    clip->owned = 0;
+    clip->nl = 0;
+    clip->lastlen = 0;
+    return clip;
+}
+
+Clip* clip_ref(Clip* clip) {
+    clip->refs++;
+    return clip;
+}
+
+void clip_unref(Clip* clip) {
+    if (--clip->refs == 0) delete clip;
+}
+
+const int KILL_RING_SIZE = 8;
+const u64 KILL_RING_BUDGET = 64*1024*1024;
+
+const usize UNDO_BLOCK_SIZE = 64*1024;
+const usize UNDO_DEFAULT_LIMIT = 128*1024*1024;
+
+// One undoable change: where its deltas start in the log and where the
+// cursor was before it.
+struct UndoStep {
+    u64 start;
+    int cx, cy;
+};
+
+// Undo history as a log of deltas, each saying that at (x, y) the
+// `removed` text was replaced by the `inserted` one. A delta is y and x
+// as varints, then each text as a varint length and its bytes, appended
+// to UNDO_BLOCK_SIZE blocks; old history goes a whole block at a time.
+// Lengths are stored doubled, plus one for a text that is a clip, which
+// is then held by a pointer instead of its bytes.
+struct UndoLog {
+    std::deque<u8*> blocks;
+    // Log offsets of the start of blocks[0] and of the end of the log.
+    u64 base;
+    u64 end;
+    // Bytes owned by the clips the log holds.
+    u64 held;
+    std::deque<UndoStep> steps;
+    // Steps [0, done) are in the text; the rest were undone.
+    usize done;
+    // Whether the last step still takes deltas, and whether it was
+    // given up on for being over the limit.
+    bool open;
+    bool lost;
+    usize limit;
+
+    // A run of typed characters stays out of the log until it ends, so
+    // that it goes in as a single delta.
+    bool typing;
+    int type_x, type_y;
+    int type_cx, type_cy;
+    std::string typed;
+    // Whether the run goes into the step that was open when it began.
+    bool type_join;
+
+    void init() {
+        base = 0;
+        end = 0;
+        held = 0;
+        done = 0;
+        open = false;
+        lost = false;
+        limit = UNDO_DEFAULT_LIMIT;
+        typing = false;
+        type_join = false;
+    }
+
+    usize bytes() {
+        return blocks.size() * UNDO_BLOCK_SIZE + steps.size() * sizeof(UndoStep) + held;
+    }
+
+    u64 step_end(usize i) {
+        return i+1 < steps.size() ? steps[i+1].start : end;
+    }
+
+    void put(const void* data, usize n) {
+        const u8* p = (const u8*)data;
+        while (n) {
+            u64 cap = base + blocks.size() * UNDO_BLOCK_SIZE;
+            if (end == cap) {
+                u8* block = (u8*)malloc(UNDO_BLOCK_SIZE);
+                if (!block) throw std::bad_alloc();
+                blocks.push_back(block);
+                cap += UNDO_BLOCK_SIZE;
+            }
+            usize k = std::min((u64)n, cap - end);
+            memcpy(blocks[(end - base) / UNDO_BLOCK_SIZE] + (end - base) % UNDO_BLOCK_SIZE, p, k);
+            end += k;
+            p += k;
+            n -= k;
+        }
+    }
+
+    void get(u64 at, void* data, usize n) {
+        u8* p = (u8*)data;
+        while (n) {
+            u64 off = (at - base) % UNDO_BLOCK_SIZE;
+            usize k = std::min((u64)n, UNDO_BLOCK_SIZE - off);
+            memcpy(p, blocks[(at - base) / UNDO_BLOCK_SIZE] + off, k);
+            at += k;
+            p += k;
+            n -= k;
+        }
+    }
+
+    void put_varint(u64 v) {
+        u8 buf[10];
+        int n = 0;
+        while (v >= 0x80) {
+            buf[n++] = (v & 0x7f) | 0x80;
+            v >>= 7;
+        }
+        buf[n++] = v;
+        put(buf, n);
+    }
+
+    u64 get_varint(u64* at) {
+        u64 v = 0;
+        for (int shift = 0;; shift += 7) {
+            u8 b;
+            get((*at)++, &b, 1);
+            v |= (u64)(b & 0x7f) << shift;
+            if (!(b & 0x80)) return v;
+        }
+    }
+
+    // Lets go of the clips held by the deltas in [from, to).
+    void release(u64 from, u64 to) {
+        for (u64 at = from; at < to;) {
+            get_varint(&at);
+            get_varint(&at);
+            for (int k = 0; k < 2; k++) {
+                u64 len = get_varint(&at);
+                if (len & 1) {
+                    Clip* clip;
+                    get(at, &clip, sizeof(clip));
+                    held -= clip->owned;
+                    clip_unref(clip);
+                }
+                at += len >> 1;
+            }
+        }
+    }
+
+    // Forgets the log from `to` on.
+    void truncate(u64 to) {
+        release(to, end);
+        end = to;
+        usize keep = (end - base + UNDO_BLOCK_SIZE-1) / UNDO_BLOCK_SIZE;
+        while (blocks.size() > keep) {
+            free(blocks.back());
+            blocks.pop_back();
+        }
+    }
+
+    // Forgets the oldest step.
+    void drop_first() {
+        release(steps[0].start, step_end(0));
+        steps.pop_front();
+        done--;
+        if (steps.empty()) {
+            clear();
+            return;
+        }
+        while (base + UNDO_BLOCK_SIZE <= steps[0].start) {
+            free(blocks.front());
+            blocks.pop_front();
+            base += UNDO_BLOCK_SIZE;
+        }
+    }
+
+    void clear() {
+        if (!steps.empty()) release(steps[0].start, end);
+        for (u8* block : blocks) free(block);
+        blocks.clear();
+        steps.clear();
+        base = 0;
+        end = 0;
+        held = 0;
+        done = 0;
+        open = false;
+    }
+};
+
+int row_index(EditorRow* row) {
+    RowNode* n = row->node;
+    int idx = node_count(n->left);
+    while (n->parent) {
+        if (n == n->parent->right) idx += node_count(n->parent->left) + n->parent->nlines;
+        n = n->parent;
+    }
+    return idx;
+}
+
+// Appends the start of every line that begins in (from, to] of `data`.
+// When `to` is the end of the file, a final line without a newline gets
+// a pretend one so that every line is followed by an entry.
+void index_lines(const char* data, usize size, u64 from, u64 to, std::vector<u64>* out) {
+    find_newlines(data, from, to, out);
+    if (to == size && size != 0 && data[size-1] != '\n') {
+        out->push_back(size+1);
+    }
+}
+
+const u64 LOAD_CHUNK_SIZE = 4*1024*1024;
+const u64 LOAD_FIRST_CHUNK_SIZE = 64*1024;
+const u64 LOAD_PARALLEL_MIN_SIZE = 64*1024*1024;
+const int LOAD_MAX_THREADS = 16;
+
+// Indexes the rest of the file on a background thread so that the first
+// screen can be painted right away. Newly found lines are handed over in
+// `pending` and picked up by `absorb` on the main thread, which is the
+// only place the line index and the row tree grow while loading.
+//
+// Large files are cut into one part per core. Helper threads index the
+// later parts whole while the loader streams the first one, and parts
+// are handed over strictly in order.
+struct FileLoader {
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::vector<u64> pending;
+    std::atomic<u64> scanned;
+    std::atomic<bool> stopping;
+    bool done;
+    bool active;
+
+    void hand_over(std::vector<u64>* found) {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.insert(pending.end(), found->begin(), found->end());
+        cond.notify_all();
+        found->clear();
+    }
+
+    // Indexes [from, to) chunk by chunk, handing each chunk over right
+    // away if `stream` is set and keeping everything in `out` otherwise.
+    void scan(const char* data, usize size, u64 from, u64 to, std::vector<u64>* out, bool stream) {
+        while (from < to && !stopping) {
+            u64 end = from + LOAD_CHUNK_SIZE < to ? from + LOAD_CHUNK_SIZE : to;
+            index_lines(data, size, from, end, out);
+            scanned += end - from;
+            from = end;
+            if (stream) hand_over(out);
+        }
+    }
+
+    static void run(FileLoader* l, const char* data, usize size, u64 from) {
+        int nparts = 1;
+        if (size - from >= LOAD_PARALLEL_MIN_SIZE) {
+            nparts = (int)std::thread::hardware_concurrency();
+            if (nparts < 1) nparts = 1;
+            if (nparts > LOAD_MAX_THREADS) nparts = LOAD_MAX_THREADS;
+        }
+
+        std::vector<u64> bounds;
+        for (int k = 0; k < nparts; k++) bounds.push_back(from + (size - from) / nparts * k);
+        bounds.push_back(size);
+
+        std::vector<std::vector<u64>> parts(nparts);
+        std::vector<std::thread> helpers;
+        for (int k = 1; k < nparts; k++) {
+            helpers.emplace_back([=, &parts] {
+                l->scan(data, size, bounds[k], bounds[k+1], &parts[k], false);
+            });
+        }
+
+        l->scan(data, size, bounds[0], bounds[1], &parts[0], true);
+        for (int k = 1; k < nparts; k++) {
+            helpers[k-1].join();
+            l->hand_over(&parts[k]);
+            std::vector<u64>().swap(parts[k]);
+        }
+
+        std::lock_guard<std::mutex> lock(l->mutex);
+        l->done = true;
+        l->cond.notify_all();
+    }
+
+    void start(FileBlock* file, u64 from) {
+        scanned = from;
+        done = false;
+        stopping = false;
+        active = true;
+        thread = std::thread(run, this, file->data, file->size, from);
     }
-}
 
-enum CmdlineStyle {
-    NONE,
-    ERROR,
-};
+    // Moves lines found so far into the index and appends them to the
+    // row tree as one run. Returns false once nothing more will arrive.
+    bool absorb(FileBlock* file, RowTree* rows) {
+        if (!active) return false;
+        std::vector<u64> found;
+        bool finished;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            found.swap(pending);
+            finished = done;
+        }
 
-struct EditorRow {
-    std::string data;
-    std::string rdata;
-    int rlen;
-    u8* hl;
+        int first = file->numlines();
+        file->linestarts.append(found);
+        int n = file->numlines() - first;
+        if (n) rows->append_run(first, n);
 
-    int len() {
-        return (int)data.size();
+        if (finished) {
+            thread.join();
+            active = false;
+        }
+        return active;
+    }
+
+    // Blocks until the next batch of lines (or the end of the file).
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [this] { return !pending.empty() || done; });
+    }
+
+    int progress(FileBlock* file) {
+        return file->size ? (int)(scanned * 100 / file->size) : 100;
+    }
+
+    void stop() {
+        if (!active) return;
+        stopping = true;
+        thread.join();
+        active = false;
     }
 };
 
+// Both mappings binary search the row's tab stops, so they cost
+// O(log tabs) whatever the length of the row.
 int row_cx_to_rx(EditorRow* row, int cx) {
     if (!row) return 0;
-    int rx = 0;
-    for (int i = 0; i < cx; i++) {
-        if (row->data[i] == '\t') {
-            rx += (TAB_STOP-1) - (rx%TAB_STOP);
-        }
-        rx++;
-    }
-    return rx;
+    TabStop* end = row->tabs + row->ntabs;
+    TabStop* t = std::partition_point(row->tabs, end, [&](const TabStop& tab) {
+        return (int)tab.pos < cx;
+    });
+    if (t == row->tabs) return cx;
+    t--;
+    return t->end_col() + (cx - t->pos - 1);
 }
 
 int row_rx_to_cx(EditorRow* row, int rx) {
     if (!row) return 0;
-    int cur_rx = 0;
-    int cx;
-    for (cx = 0; cx < row->len(); cx++) {
-        if (row->data[cx] == '\t') {
-            cur_rx += (TAB_STOP - 1) - (cur_rx % TAB_STOP);
-        }
-        cur_rx++;
-        if (cur_rx > rx) return cx;
-    }
-    return cx;
+    TabStop* end = row->tabs + row->ntabs;
+    TabStop* t = std::partition_point(row->tabs, end, [&](const TabStop& tab) {
+        return (int)tab.col <= rx;
+    });
+    if (t == row->tabs) return std::min(rx, row->len());
+    t--;
+    if (rx < (int)t->end_col()) return t->pos;
+    return std::min((int)(t->pos + 1 + rx - t->end_col()), row->len());
 }
 
+// The whole screen as a grid of cells, kept as one array of characters
+// and one of faces so that runs can be copied in and out as spans.
+// draw_* fill one of these and flush_frame() sends the terminal only
+// what differs from the last one.
+struct Frame {
+    int rows, cols;
+    std::vector<char> chars;
+    std::vector<u8> faces;
+
+    void resize(int rows, int cols) {
+        this->rows = rows;
+        this->cols = cols;
+        chars.assign((usize)rows * cols, ' ');
+        faces.assign((usize)rows * cols, HL_NORMAL);
+    }
+
+    char* chars_at(int y) {
+        return &chars[(usize)y * cols];
+    }
+
+    u8* faces_at(int y) {
+        return &faces[(usize)y * cols];
+    }
+
+    bool row_equals(int y, Frame& other, int oy) {
+        return memcmp(chars_at(y), other.chars_at(oy), cols) == 0
+            && memcmp(faces_at(y), other.faces_at(oy), cols) == 0;
+    }
+};
+
 struct EditorConfig {
     int screenrows;
     int screencols;
@@ -234,40 +2325,76 @@ struct EditorConfig {
     int rowoff;
     int coloff;
     EditorMode mode;
+    // Count typed ahead of a normal mode command; 0 while there is none.
+    int count;
     std::string path;
     bool dirty;
     int cmdx, cmdoff;
-    int hltsx, hltsy, hltex, hltey;
-    EditorSyntax* syn;
+    const EditorSyntax* syn;
+    u32 hl_gen;
+    int syn_frontier;
 
     termios ogtermios;
     std::string abuf;
-    std::vector<EditorRow*> rows;
+    Frame frame;
+    Frame lastframe;
+    bool lastframe_valid;
+    int lastframe_rowoff;
+    int pen_y, pen_x;
+    u8 pen;
+    usize frame_bytes;
+    u64 frame_allocs;
+    FileBlock file;
+    RowTree rows;
+    FileLoader loader;
     std::string cmdline;
     time_t cmdline_msg_time;
     CmdlineStyle cmdline_style;
     int quit_times;
     std::string search_default;
-    std::string clipboard;
+    bool search_icase;
+    bool search_regex;
+    SearchMatches matches;
+    IncrementalSearch isearch;
+    SearchHighlight search_hl;
+    UndoLog undo;
+    // Bumped on every change to the text.
+    u64 text_gen;
+    // Cut text, newest first.
+    std::deque<Clip*> kill_ring;
     bool skip_after_action;
 
     std::ofstream keylog;
 
     int numrows() {
-        return (int)rows.size();
+        return rows.size();
     }
 
     int lastrow_idx() {
-        return (int)rows.size()-1;
+        return rows.size()-1;
     }
 
     int cmdline_len() {
         return (int)cmdline.size();
     }
 
+    // Returns whether row `at` exists, waiting for the loader to reach
+    // it if the file is still being read.
+    bool has_row(int at) {
+        while (at >= numrows() && loader.active) {
+            loader.wait();
+            loader.absorb(&file, &rows);
+        }
+        return at < numrows();
+    }
+
+    void wait_for_load() {
+        has_row(INT32_MAX);
+    }
+
     EditorRow* get_row_at(int at) {
         if (at < 0 || at >= numrows()) return NULL;
-        return rows[at];
+        return rows.get(at);
     }
 
     void set_cpos(int cx, int cy) {
@@ -276,36 +2403,9 @@ struct EditorConfig {
         this->tx = row_cx_to_rx(get_row_at(cy), cx);
     }
 
-    char get_char(int cx, int cy) {
-        if (cy >= numrows()) return '\0';
-        if (cx == get_row_at(cy)->len()) return '\n';
-        return get_row_at(cy)->data[cx];
-    }
-
-    char get_char_at_cpos() {
-        return get_char(cx, cy);
-    }
-
-    char get_char_at_lpos() {
-        int x = cx, y = cy;
-        if (x == 0 && y == 0) return '\0';
-        if (x == 0) {
-            y--;
-            x = get_row_at(y)->len();
-        } else x--;
-        return get_char(x, y);
-    }
-
-    bool is_cpos_at_end() {
-        if (cy == lastrow_idx() && cx == get_row_at(cy)->len()) return true;
-        return false;
-    }
-
-    void reset_hlt() {
-        hltsx = 0;
-        hltsy = 0;
-        hltex = 0;
-        hltey = 0;
+    void mark_dirty() {
+        dirty = true;
+        text_gen++;
     }
 };
 EditorConfig E;
@@ -322,17 +2422,23 @@ void disable_raw_mode() {
 
 namespace core {
     void succ_exit() {
+        E.isearch.stop();
+        E.loader.stop();
         disable_raw_mode();
         exit(0);
     }
 
     void error_exit_from(const char* from) {
+        E.isearch.stop();
+        E.loader.stop();
         disable_raw_mode();
         perror(from);
         exit(1);
     }
 
     void error_exit_with_msg(const char* s) {
+        E.isearch.stop();
+        E.loader.stop();
         disable_raw_mode();
         fputs(s, stderr);
         fputs("\n", stderr);
@@ -364,7 +2470,11 @@ void enable_raw_mode() {
 int read_key() {
     char buf[64];
     int nread;
-    while ((nread = read(STDIN_FILENO, buf, 64)) == 0);
+    while ((nread = read(STDIN_FILENO, buf, 64)) == 0) {
+        // Let the main loop repaint the loading progress or the
+        // match found by a running search.
+        if (E.loader.active || E.isearch.active) return NO_KEY;
+    }
     if (nread == -1 && errno != EAGAIN) core::error_exit_from("read");
 
     for (int i = 0; i < nread; i++) {
@@ -457,61 +2567,146 @@ bool is_char_printable(int c) {
     return c >= 32 && c <= 126;
 }
 
+struct SeparatorTable {
+    bool sep[256];
+};
+
+constexpr SeparatorTable make_separator_table() {
+    SeparatorTable t = {};
+    for (char c : std::string_view(" \t\n\v\f\r,.()+-/*=~%<>[];")) t.sep[(u8)c] = true;
+    t.sep[0] = true;
+    return t;
+}
+
+constexpr SeparatorTable SEPARATORS = make_separator_table();
+
 bool is_char_separator(int c) {
-    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
-}
-
-bool match_syn_word(std::string* wordlist, EditorRow* row, int* i, EditorHighlight hl) {
-    bool found = false;
-    for (int j = 0; wordlist[j] != ""; j++) {
-        int klen = wordlist[j].size();
-        if (!strncmp(&row->rdata[*i], wordlist[j].c_str(), klen) &&
-            is_char_separator(row->rdata[*i+klen])) {
-            memset(&row->hl[*i], hl, klen);
-            *i += klen;
-            found = true;
-            break;
+    return SEPARATORS.sep[(u8)c];
+}
+
+// Terminators of raw strings seen so far, e.g. `)xyz"` for `R"xyz(`.
+std::vector<std::string> raw_string_ends;
+
+u32 raw_string_state(const std::string& end) {
+    usize idx = 0;
+    while (idx < raw_string_ends.size() && raw_string_ends[idx] != end) idx++;
+    if (idx == raw_string_ends.size()) raw_string_ends.push_back(end);
+    return HLS_RAW_STRING | (idx << 8);
+}
+
+// Adds bytes [start, start+len) to the spans in `out`, growing the
+// last span when the new one continues it in the same class.
+void hl_mark(std::vector<HlSpan>* out, int start, int len, EditorHighlight kind) {
+    if (!out || len <= 0) return;
+    if (!out->empty()) {
+        HlSpan& last = out->back();
+        if (last.hl == (u32)kind && last.start + last.len == (u32)start && last.len + (u32)len <= HL_SPAN_MAX_LEN) {
+            last.len += len;
+            return;
         }
     }
-    return found;
+    while ((u32)len > HL_SPAN_MAX_LEN) {
+        out->push_back({ (u32)start, HL_SPAN_MAX_LEN, (u32)kind });
+        start += HL_SPAN_MAX_LEN;
+        len -= HL_SPAN_MAX_LEN;
+    }
+    out->push_back({ (u32)start, (u32)len, (u32)kind });
 }
 
-void update_row_syntax(EditorRow* row) {
-    int rlen = row->rlen;
-    row->hl = (u8*)realloc(row->hl, rlen);
-    memset(row->hl, HL_NORMAL, rlen);
+// Lexes `text` from `at`, appending spans to `out` (which may be NULL
+// when only the state is wanted), and leaves `at` at the first point
+// between two tokens at or past `stop`. Resuming from there gives the
+// same spans as lexing the whole line in one go.
+void syntax_lex(std::string_view text, LexPoint* at, usize stop, std::vector<HlSpan>* out) {
+    int len = text.size();
 
-    if (E.syn == NULL) return;
-
-    std::string* keywords = E.syn->keywords;
-    std::string* types = E.syn->types;
-    std::string* consts = E.syn->consts;
+    if (E.syn == NULL) {
+        *at = { (u32)len, HLS_NORMAL, true, false };
+        return;
+    }
 
-    std::string scs = E.syn->singleline_comment_start;
+    std::string_view scs = E.syn->singleline_comment_start;
+    std::string_view mcs = E.syn->multiline_comment_start;
+    std::string_view mce = E.syn->multiline_comment_end;
 
-    bool prev_sep = true;
+    bool prev_sep = at->prev_sep;
     int which_string = 0;
-    int i = 0;
+    int i = at->pos;
+    // Index just past the last byte highlighted as a number.
+    int number_end = at->prev_number ? i : -1;
+
+    // Finish whatever the previous line left open first.
+    if (HLS_KIND(at->state) != HLS_NORMAL) {
+        std::string_view end = HLS_KIND(at->state) == HLS_COMMENT ? mce : raw_string_ends[HLS_RAW_END(at->state)];
+        EditorHighlight kind = HLS_KIND(at->state) == HLS_COMMENT ? HL_COMMENT : HL_STRING;
+        usize close = text.find(end, i);
+        if (close == std::string_view::npos) {
+            hl_mark(out, i, len-i, kind);
+            at->pos = len;
+            return;
+        }
+        hl_mark(out, i, close + end.size() - i, kind);
+        i = close + end.size();
+    }
 
-    while (i < rlen) {
-        char c = row->rdata[i];
-        EditorHighlight prev_hl = (i > 0) ? (EditorHighlight)row->hl[i-1] : HL_NORMAL;
+    while (i < len) {
+        if ((usize)i >= stop && !which_string) break;
+        char c = text[i];
+        bool prev_number = (number_end == i);
 
         if (scs.size() && !which_string) {
-            if (!strncmp(&row->rdata[i], scs.c_str(), scs.size())) {
-                memset(&row->hl[i], HL_COMMENT, rlen-i);
+            if (text.compare(i, scs.size(), scs) == 0) {
+                hl_mark(out, i, len-i, HL_COMMENT);
+                i = len;
                 break;
             }
         }
 
+        if (mcs.size() && !which_string) {
+            if (text.compare(i, mcs.size(), mcs) == 0) {
+                usize close = text.find(mce, i + mcs.size());
+                if (close == std::string_view::npos) {
+                    hl_mark(out, i, len-i, HL_COMMENT);
+                    *at = { (u32)len, HLS_COMMENT, true, false };
+                    return;
+                }
+                int end = close + mce.size();
+                hl_mark(out, i, end-i, HL_COMMENT);
+                i = end;
+                prev_sep = true;
+                continue;
+            }
+        }
+
+        if ((E.syn->flags & EDSYN_HLT_RAW_STRING) && !which_string && prev_sep &&
+            c == 'R' && i+1 < len && text[i+1] == '"') {
+            usize open = text.find('(', i+2);
+            std::string_view delim = text.substr(i+2, open - (i+2));
+            if (open != std::string_view::npos && delim.size() <= 16 &&
+                delim.find_first_of(" )\\\t\"") == std::string_view::npos) {
+                std::string end = ")" + std::string(delim) + "\"";
+                usize close = text.find(end, open+1);
+                if (close == std::string_view::npos) {
+                    hl_mark(out, i, len-i, HL_STRING);
+                    *at = { (u32)len, raw_string_state(end), true, false };
+                    return;
+                }
+                int stop = close + end.size();
+                hl_mark(out, i, stop-i, HL_STRING);
+                i = stop;
+                prev_sep = true;
+                continue;
+            }
+        }
+
         if (E.syn->flags & EDSYN_HLT_STRING) {
             if (which_string) {
-                row->hl[i] = HL_STRING;
-                if (c == '\\' && i+1 < rlen) {
-                    row->hl[i+1] = HL_STRING;
+                if (c == '\\' && i+1 < len) {
+                    hl_mark(out, i, 2, HL_STRING);
                     i += 2;
                     continue;
                 }
+                hl_mark(out, i, 1, HL_STRING);
                 if (c == which_string) which_string = 0;
                 i++;
                 prev_sep = 1;
@@ -519,7 +2714,7 @@ void update_row_syntax(EditorRow* row) {
             } else {
                 if ((c == '"' || c == '\'')) {
                     which_string = c;
-                    row->hl[i] = HL_STRING;
+                    hl_mark(out, i, 1, HL_STRING);
                     i++;
                     continue;
                 }
@@ -527,24 +2722,22 @@ void update_row_syntax(EditorRow* row) {
         }
 
         if (E.syn->flags & EDSYN_HLT_NUMBER) {
-            if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) || (c == '.' && prev_hl == HL_NUMBER)) {
-                row->hl[i] = HL_NUMBER;
+            if ((isdigit(c) && (prev_sep || prev_number)) || (c == '.' && prev_number)) {
+                hl_mark(out, i, 1, HL_NUMBER);
                 i++;
+                number_end = i;
                 prev_sep = false;
                 continue;
             }
         }
 
         if (prev_sep) {
-            bool found = match_syn_word(keywords, row, &i, HL_KEYWORD);
-            if (!found) {
-                found = match_syn_word(types, row, &i, HL_TYPE);
-                if (!found) {
-                    found = match_syn_word(consts, row, &i, HL_CONST);
-                }
-            }
-
-            if (found) {
+            int end = i;
+            while (end < len && !is_char_separator(text[end])) end++;
+            EditorHighlight kind = E.syn->words->find(text.substr(i, end-i));
+            if (kind != HL_NORMAL) {
+                hl_mark(out, i, end-i, kind);
+                i = end;
                 prev_sep = 0;
                 continue;
             }
@@ -553,88 +2746,841 @@ void update_row_syntax(EditorRow* row) {
         prev_sep = is_char_separator(c);
         i++;
     }
+    *at = { (u32)i, HLS_NORMAL, prev_sep, number_end == i };
 }
 
-void update_row(EditorRow* row) {
-    row->rdata.reserve(row->len());
-    row->rdata.clear();
-    for (int i = 0; i < row->len(); i++) {
-        if (row->data[i] == '\t') {
-            row->rdata.push_back(' ');
-            while (row->rdata.size() % TAB_STOP != 0) {
-                row->rdata.push_back(' ');
-            }
-        } else {
-            row->rdata.push_back(row->data[i]);
+// Highlights one line, starting in lexer state `state`, and returns the
+// state the line ends in.
+u32 syntax_highlight(std::string_view text, u32 state, std::vector<HlSpan>* out) {
+    LexPoint at = { 0, state, true, false };
+    syntax_lex(text, &at, text.size(), out);
+    return at.state;
+}
+
+// Lexes a line only for the state it ends in.
+u32 syntax_scan(std::string_view text, u32 state) {
+    return syntax_highlight(text, state, NULL);
+}
+
+// Stores `spans`, shifted back by `base`, in the arena buffer `*hl`
+// that held `*nhl` spans.
+void hl_store(HlSpan** hl, u32* nhl, const std::vector<HlSpan>& spans, u32 base) {
+    usize bytes = spans.size() * sizeof(HlSpan);
+    *hl = (HlSpan*)hl_arena.reuse((u8*)*hl, *nhl * sizeof(HlSpan), bytes);
+    for (usize k = 0; k < spans.size(); k++) {
+        (*hl)[k] = spans[k];
+        (*hl)[k].start -= base;
+    }
+    *nhl = spans.size();
+}
+
+void free_row_chunks(EditorRow* row) {
+    for (u32 k = 0; k < row->nchunks; k++) {
+        hl_arena.free((u8*)row->chunks[k].hl, row->chunks[k].nhl * sizeof(HlSpan));
+    }
+    hl_arena.free((u8*)row->chunks, row->nchunks * sizeof(HlChunk));
+    row->chunks = NULL;
+    row->nchunks = 0;
+}
+
+// Re-lexes a long row chunk by chunk. A chunk is kept as it is when it
+// is current and lexing has reached its start in the same state it was
+// lexed from; otherwise it is lexed again up to where the next chunk
+// began, which is where lexing usually falls back into step.
+void update_row_chunks(EditorRow* row, u32 state) {
+    static std::vector<HlChunk> out;
+    static std::vector<HlSpan> spans;
+    std::string_view text = row->text();
+    HlChunk* old = row->chunks;
+    u32 nold = row->nchunks;
+    out.clear();
+
+    LexPoint at = { 0, state, true, false };
+    u32 c = 0;
+    while (at.pos < text.size()) {
+        while (c < nold && old[c].from.pos < at.pos) {
+            hl_arena.free((u8*)old[c].hl, old[c].nhl * sizeof(HlSpan));
+            c++;
+        }
+        if (c < nold && old[c].gen == E.hl_gen && old[c].from.same_as(at)) {
+            out.push_back(old[c]);
+            at = (c+1 < nold) ? old[c+1].from : LexPoint{ (u32)text.size(), row->hl_end, true, false };
+            c++;
+            continue;
+        }
+
+        // Aim for the next chunk's start, merging chunks that have shrunk
+        // and splitting ones that have grown.
+        u32 next = c;
+        while (next < nold && old[next].from.pos <= at.pos) next++;
+        while (next+1 < nold && old[next].from.pos - at.pos < HL_CHUNK/4) next++;
+        usize stop = at.pos + HL_CHUNK;
+        if (next < nold && old[next].from.pos - at.pos <= 2*HL_CHUNK) stop = old[next].from.pos;
+
+        HlChunk chunk = { at, E.hl_gen, NULL, 0 };
+        if (c < nold && old[c].from.pos == at.pos) {
+            chunk.hl = old[c].hl;
+            chunk.nhl = old[c].nhl;
+            c++;
         }
+        spans.clear();
+        syntax_lex(text, &at, stop, &spans);
+        hl_store(&chunk.hl, &chunk.nhl, spans, chunk.from.pos);
+        out.push_back(chunk);
+    }
+    for (; c < nold; c++) hl_arena.free((u8*)old[c].hl, old[c].nhl * sizeof(HlSpan));
+
+    usize bytes = out.size() * sizeof(HlChunk);
+    row->chunks = (HlChunk*)hl_arena.reuse((u8*)old, nold * sizeof(HlChunk), bytes);
+    if (bytes) memcpy(row->chunks, out.data(), bytes);
+    row->nchunks = out.size();
+    row->hl_end = at.state;
+}
+
+void update_row_syntax(EditorRow* row, u32 state) {
+    row->hl_start = state;
+    row->hl_gen = E.hl_gen;
+    if ((u32)row->len() > HL_CHUNK) {
+        hl_arena.free((u8*)row->hl, row->nhl * sizeof(HlSpan));
+        row->hl = NULL;
+        row->nhl = 0;
+        update_row_chunks(row, state);
+        return;
     }
 
-    // Compute size before adding '\0'
-    row->rlen = row->rdata.size();
-    row->rdata.push_back('\0');
-    E.dirty = true;
+    static std::vector<HlSpan> spans;
+    spans.clear();
+    free_row_chunks(row);
+    row->hl_end = syntax_highlight(row->text(), state, &spans);
+    hl_store(&row->hl, &row->nhl, spans, 0);
+}
 
-    update_row_syntax(row);
+// A row's end state can be reused whenever its text and the state it
+// was lexed from are unchanged.
+u32 syntax_state_after(int at, u32 state) {
+    int off;
+    RowNode* n = E.rows.find(at, &off);
+    if (!n->row) return syntax_scan(E.file.line(n->first + off), state);
+    EditorRow* row = n->row;
+    if (row->hl_gen == E.hl_gen && row->hl_start == state) return row->hl_end;
+    // Its highlighting is from another start state, so the row must not
+    // be trusted again until it is highlighted anew.
+    row->hl_gen = 0;
+    // Long rows keep their chunks so that lexing past them after an
+    // edit only redoes the chunks it touched.
+    if ((u32)row->len() > HL_CHUNK) {
+        update_row_syntax(row, state);
+        return row->hl_end;
+    }
+    return syntax_scan(row->text(), state);
 }
 
-EditorRow* insert_row(int at, const std::string& data) {
-    if (at < 0 || at > E.numrows()) return NULL;
-    EditorRow* row = new EditorRow();
+// Lexer state at the start of row `at`. Rows above E.syn_frontier that
+// are highlighted carry a trusted end state; otherwise we lex forward
+// from at most HL_SYNC_LINES rows back, assuming a normal state there.
+u32 syntax_state_before(int at) {
+    int limit = at - HL_SYNC_LINES;
+    if (limit < 0) limit = 0;
+
+    int k = at-1;
+    u32 state = HLS_NORMAL;
+    for (; k >= limit; k--) {
+        int off;
+        RowNode* n = E.rows.find(k, &off);
+        if (n->row && n->row->hl_gen == E.hl_gen && k < E.syn_frontier) {
+            state = n->row->hl_end;
+            break;
+        }
+    }
+    for (int j = (k < limit ? limit : k+1); j < at; j++) {
+        state = syntax_state_after(j, state);
+    }
+    return state;
+}
+
+// Brings the highlighting of rows [from, to) up to date. An edit only
+// pulls the frontier back to the edited row, so this re-lexes rows
+// until their start states match what they were highlighted from
+// again, and never looks further down than `to`.
+void syntax_update_rows(int from, int to) {
+    if (to > E.numrows()) to = E.numrows();
+    if (from >= to) return;
+
+    int start = from;
+    if (E.syn_frontier < from && from - E.syn_frontier <= HL_SYNC_LINES) start = E.syn_frontier;
+
+    u32 state = syntax_state_before(start);
+    for (int j = start; j < to; j++) {
+        if (j < from) {
+            state = syntax_state_after(j, state);
+            continue;
+        }
+        EditorRow* row = E.get_row_at(j);
+        if (row->hl_gen != E.hl_gen || row->hl_start != state) update_row_syntax(row, state);
+        state = row->hl_end;
+    }
+    if (start <= E.syn_frontier && E.syn_frontier < to) E.syn_frontier = to;
+}
+
+void syntax_invalidate_from(int at) {
+    if (at < E.syn_frontier) E.syn_frontier = at;
+}
+
+// Works out the columns of tabs [from, n), given those before them.
+void tabs_fill_cols(TabStop* tabs, u32 from, u32 n) {
+    u32 col = from ? tabs[from-1].end_col() : 0;
+    u32 pos = from ? tabs[from-1].pos+1 : 0;
+    for (u32 k = from; k < n; k++) {
+        tabs[k].col = col + (tabs[k].pos - pos);
+        col = tabs[k].end_col();
+        pos = tabs[k].pos+1;
+    }
+}
+
+// Rebuilds the row's tab index after its text changed.
+void update_row_render(EditorRow* row) {
+    static std::vector<u64> found;
+    std::string_view text = row->text();
+    found.clear();
+    find_bytes(text.data(), 0, text.size(), '\t', &found);
+
+    u32 ntabs = found.size();
+    row->tabs = (TabStop*)tab_arena.reuse(
+        (u8*)row->tabs,
+        row->ntabs * sizeof(TabStop),
+        ntabs * sizeof(TabStop));
+    row->ntabs = ntabs;
+    for (u32 k = 0; k < ntabs; k++) row->tabs[k].pos = found[k]-1;
+    tabs_fill_cols(row->tabs, 0, ntabs);
+
+    // Highlighting is redone lazily for the rows that get drawn.
+    free_row_chunks(row);
+    row->hl_gen = 0;
+    row->found_gen = 0;
+}
+
+void update_row(EditorRow* row) {
+    E.mark_dirty();
+    update_row_render(row);
+    syntax_invalidate_from(row_index(row));
+}
+
+// Patches the tab index after `removed` bytes at `at` were replaced by
+// `added` new ones: only the new bytes are scanned, and the tabs past
+// them are moved along.
+void row_splice_tabs(EditorRow* row, u32 at, u32 removed, u32 added) {
+    static std::vector<u64> found;
+    static std::vector<TabStop> tail;
+    std::string_view text = row->text();
+    found.clear();
+    find_bytes(text.data(), at, at + added, '\t', &found);
+
+    TabStop* end = row->tabs + row->ntabs;
+    TabStop* first = std::partition_point(row->tabs, end, [&](const TabStop& t) { return t.pos < at; });
+    TabStop* last = std::partition_point(first, end, [&](const TabStop& t) { return t.pos < at + removed; });
+    if (found.empty() && first == last && last == end) return;
+    tail.assign(last, end);
+
+    u32 keep = first - row->tabs;
+    u32 ntabs = keep + found.size() + tail.size();
+    usize old_bytes = row->ntabs * sizeof(TabStop);
+    usize bytes = ntabs * sizeof(TabStop);
+    TabStop* tabs = row->tabs;
+    if (!tabs || !bytes || ByteArena::capacity(bytes) != ByteArena::capacity(old_bytes)) {
+        tabs = bytes ? (TabStop*)tab_arena.alloc(bytes) : NULL;
+        if (keep) memcpy(tabs, row->tabs, keep * sizeof(TabStop));
+        tab_arena.free((u8*)row->tabs, old_bytes);
+    }
+
+    u32 k = keep;
+    for (u64 off : found) tabs[k++].pos = off-1;
+    for (TabStop& t : tail) tabs[k++].pos = t.pos + added - removed;
+    row->tabs = tabs;
+    row->ntabs = ntabs;
+    tabs_fill_cols(tabs, keep, ntabs);
+}
+
+// Marks the chunks of a long row that an edit of `removed` bytes at
+// `at` into `added` new ones can have changed, and moves the rest
+// along. Chunks that began inside the removed bytes are folded into the
+// one the edit starts in.
+void row_splice_chunks(EditorRow* row, u32 at, u32 removed, u32 added) {
+    static std::vector<HlChunk> kept;
+    HlChunk* chunks = row->chunks;
+    HlChunk* end = chunks + row->nchunks;
+    if (!chunks) return;
+
+    u32 j = std::partition_point(chunks, end, [&](const HlChunk& c) { return c.from.pos <= at; }) - chunks - 1;
+    u32 k = std::partition_point(chunks + j+1, end, [&](const HlChunk& c) { return c.from.pos <= at + removed; }) - chunks;
+    for (u32 m = k; m < row->nchunks; m++) chunks[m].from.pos += added - removed;
+
+    // Lexing the chunk before can look ahead into the edited one.
+    chunks[j].gen = 0;
+    if (j) chunks[j-1].gen = 0;
+
+    if (k == j+1) return;
+    for (u32 m = j+1; m < k; m++) hl_arena.free((u8*)chunks[m].hl, chunks[m].nhl * sizeof(HlSpan));
+    kept.assign(chunks, chunks + j+1);
+    kept.insert(kept.end(), chunks + k, end);
+    usize bytes = kept.size() * sizeof(HlChunk);
+    row->chunks = (HlChunk*)hl_arena.reuse((u8*)chunks, row->nchunks * sizeof(HlChunk), bytes);
+    memcpy(row->chunks, kept.data(), bytes);
+    row->nchunks = kept.size();
+}
+
+// Updates the row after `removed` bytes at `at` were replaced by
+// `added` new ones, redoing only the work near the edit so that editing
+// a very long row costs about the same as editing a short one.
+void update_row_edit(EditorRow* row, int at, int removed, int added) {
+    E.mark_dirty();
+    row_splice_tabs(row, at, removed, added);
+    row_splice_chunks(row, at, removed, added);
+    row->hl_gen = 0;
+    row->found_gen = 0;
+    syntax_invalidate_from(row_index(row));
+}
+
+EditorRow* new_owned_row(std::string_view data) {
+    EditorRow* row = pool_new<EditorRow>(&row_pool);
     row->data = data;
+    row->owned = true;
+    row->tabs = NULL;
+    row->ntabs = 0;
     row->hl = NULL;
-    E.rows.insert(E.rows.begin() + at, row);
+    row->nhl = 0;
+    row->chunks = NULL;
+    row->nchunks = 0;
+    row->found = NULL;
+    row->nfound = 0;
+    row->found_gen = 0;
+    return row;
+}
+
+EditorRow* insert_row(int at, std::string_view data) {
+    if (at < 0 || at > E.numrows()) return NULL;
+    EditorRow* row = new_owned_row(data);
+    E.rows.insert(at, row);
     update_row(row);
     return row;
 }
 
 void free_row(EditorRow* row) {
-    free(row->hl);
-    delete row;
+    hl_arena.free((u8*)row->hl, row->nhl * sizeof(HlSpan));
+    hl_arena.free((u8*)row->found, row->nfound * sizeof(MatchSpan));
+    free_row_chunks(row);
+    tab_arena.free((u8*)row->tabs, row->ntabs * sizeof(TabStop));
+    pool_delete(&row_pool, row);
+}
+
+// Size of the text of every row under `n`, each followed by a newline.
+usize nodes_text_size(RowNode* n) {
+    usize size = 0;
+    auto add = [&](RowNode* m, int) {
+        if (m->row) {
+            size += m->row->len() + 1;
+        } else {
+            size += E.file.linestarts[m->first + m->nlines] - E.file.linestarts[m->first];
+        }
+    };
+    int idx = 0;
+    node_each(n, &idx, add);
+    return size;
+}
+
+// Appends the text of every row under `n` to *out, each followed by a
+// newline.
+void nodes_append_text(RowNode* n, std::string* out) {
+    auto append = [&](RowNode* m, int) {
+        if (m->row) {
+            out->append(m->row->text());
+            out->push_back('\n');
+        } else {
+            // Untouched lines are copied out of the file block in one go.
+            out->append(E.file.lines_span(m->first, m->nlines));
+            if (E.file.linestarts[m->first + m->nlines] > E.file.size) out->push_back('\n');
+        }
+    };
+    int idx = 0;
+    node_each(n, &idx, append);
+}
+
+void free_nodes(RowNode* n) {
+    if (!n) return;
+    free_nodes(n->left);
+    free_nodes(n->right);
+    if (n->row) free_row(n->row);
+    node_pool.free(n);
+}
+
+// Adds `text`, which holds no newline, to the end of the clip.
+void clip_add_text(Clip* clip, std::string text, bool newline) {
+    clip->size += text.size() + newline;
+    clip->owned += text.size();
+    clip->lastlen += text.size();
+    if (newline) {
+        clip->nl++;
+        clip->lastlen = 0;
+    }
+    clip->pieces.push_back({0, 0, std::move(text), newline});
+}
+
+void clip_add_lines(Clip* clip, int first, int nlines) {
+    clip->size += E.file.linestarts[first + nlines] - E.file.linestarts[first];
+    clip->nl += nlines;
+    clip->lastlen = 0;
+    ClipPiece* last = clip->pieces.empty() ? NULL : &clip->pieces.back();
+    if (last && last->nlines && last->first + last->nlines == first) {
+        last->nlines += nlines;
+        return;
+    }
+    clip->pieces.push_back({first, nlines, "", false});
+}
+
+// Drops the newline the clip ends with; its last piece must end a
+// line.
+void clip_chop_newline(Clip* clip) {
+    ClipPiece* last = &clip->pieces.back();
+    if (last->nlines == 0) {
+        last->newline = false;
+        clip->size--;
+        clip->nl--;
+        clip->lastlen = last->text.size();
+        return;
+    }
+    int line = last->first + last->nlines - 1;
+    clip->size -= E.file.linestarts[line+1] - E.file.linestarts[line];
+    clip->nl--;
+    if (--last->nlines == 0) clip->pieces.pop_back();
+    clip_add_text(clip, std::string(E.file.line(line)), false);
+}
+
+// Deletes rows [at, at+n) in one operation and, unless `out` is NULL,
+// adds them to it, each row followed by a newline. Runs go in by
+// reference and rows hand over their strings.
+void delete_rows(int at, int n, Clip* out) {
+    if (n <= 0) return;
+    RowNode* span = E.rows.remove_range(at, n);
+    syntax_invalidate_from(at);
+    if (out) {
+        auto add = [&](RowNode* m, int) {
+            if (m->row) clip_add_text(out, std::move(m->row->own()), true);
+            else clip_add_lines(out, m->first, m->nlines);
+        };
+        int idx = 0;
+        node_each(span, &idx, add);
+    }
+    free_nodes(span);
+    E.mark_dirty();
 }
 
 std::string delete_row(int at) {
         if (at < 0 || at >= E.numrows()) return "";
-    EditorRow* row = E.get_row_at(at);
-    std::string rowdata = row->data;
-    free_row(row);
-    E.rows.erase(E.rows.begin() + at);
-    E.dirty = true;
+    RowNode* node = E.rows.remove(at);
+    syntax_invalidate_from(at);
+    std::string rowdata;
+    if (node->row) {
+        rowdata = node->row->text();
+        free_row(node->row);
+    } else {
+        rowdata = E.file.line(node->first);
+    }
+    node_pool.free(node);
+    E.mark_dirty();
     return rowdata;
 }
 
 void row_insert_char(EditorRow* row, int at, int c) {
     if (at < 0 || at > row->len()) at = row->len();
-    row->data.insert(at, 1, c);
-    update_row(row);
+    row->own().insert(at, 1, c);
+    update_row_edit(row, at, 0, 1);
 }
 
-void row_insert_string(EditorRow* row, int at, const std::string& str) {
+void row_insert_string(EditorRow* row, int at, std::string_view str) {
     if (at < 0 || at > row->len()) at = row->len();
-    row->data.insert(at, str);
-    update_row(row);
+    row->own().insert(at, str);
+    update_row_edit(row, at, 0, str.size());
 }
 
 std::string row_delete_range(EditorRow* row, int at, int len) {
     if (at < 0 || at+len > row->len() || len == 0) return "";
-    std::string copy = row->data.substr(at, len);
-    row->data.erase(at, len);
-    update_row(row);
+    std::string copy(row->text().substr(at, len));
+    row->own().erase(at, len);
+    update_row_edit(row, at, len, 0);
     return copy;
 }
 
-void row_append_string(EditorRow* row, const std::string& str) {
-    row->data += str;
-    update_row(row);
+void row_append_string(EditorRow* row, std::string_view str) {
+    int at = row->len();
+    row->own() += str;
+    update_row_edit(row, at, 0, str.size());
+}
+
+void row_truncate(EditorRow* row, int at) {
+    if (at < 0 || at >= row->len()) return;
+    int removed = row->len() - at;
+    if (row->owned) row->data.resize(at);
+    else row->srclen = at;
+    update_row_edit(row, at, removed, 0);
+}
+
+// Inserts `text` at (cx, cy) in one go: the text is split into rows
+// once, the new rows are spliced into the tree together and each
+// affected row is re-rendered once. Returns the position just past the
+// inserted text in *endx, *endy.
+void insert_text(int cx, int cy, std::string_view text, int* endx, int* endy) {
+    EditorRow* row = E.get_row_at(cy);
+    if (cx < 0 || cx > row->len()) cx = row->len();
+    usize nl = text.find('\n');
+    if (nl == std::string_view::npos) {
+        row_insert_string(row, cx, text);
+        *endx = cx + text.size();
+        *endy = cy;
+        return;
+    }
+
+    std::string tail(row->text().substr(cx));
+    row->own().replace(cx, std::string::npos, text.substr(0, nl));
+    update_row_edit(row, cx, tail.size(), nl);
+
+    std::vector<EditorRow*> rows;
+    usize start = nl+1;
+    for (;;) {
+        usize end = text.find('\n', start);
+        if (end == std::string_view::npos) break;
+        rows.push_back(new_owned_row(text.substr(start, end-start)));
+        start = end+1;
+    }
+    std::string_view last = text.substr(start);
+    rows.push_back(new_owned_row(last));
+    rows.back()->data += tail;
+
+    E.rows.insert_many(cy+1, rows);
+    for (EditorRow* r : rows) update_row_render(r);
+    *endx = last.size();
+    *endy = cy + rows.size();
+}
+
+// Inserts `clip` at (cx, cy) like insert_text. The lines it holds by
+// reference go back in as runs of the file block, so only the rows it
+// has text of its own for are built.
+void insert_clip(int cx, int cy, Clip* clip, int* endx, int* endy) {
+    EditorRow* row = E.get_row_at(cy);
+    if (cx < 0 || cx > row->len()) cx = row->len();
+    if (clip->nl == 0) {
+        std::string text;
+        for (ClipPiece& p : clip->pieces) text += p.text;
+        row_insert_string(row, cx, text);
+        *endx = cx + text.size();
+        *endy = cy;
+        return;
+    }
+
+    std::string tail(row->text().substr(cx));
+    std::string cur;
+    bool first = true;
+    std::vector<RowNode*> nodes;
+    int nlines = 0;
+    // Ends the line being built: the first one goes into the row at cy
+    // and the rest become rows of their own.
+    auto end_line = [&]() {
+        if (first) {
+            row->own().replace(cx, std::string::npos, cur);
+            update_row_edit(row, cx, tail.size(), cur.size());
+            first = false;
+        } else {
+            nodes.push_back(new_node(new_owned_row(cur), 0, 1));
+            nlines++;
+        }
+        cur.clear();
+    };
+    for (ClipPiece& p : clip->pieces) {
+        if (p.nlines == 0) {
+            cur += p.text;
+            if (p.newline) end_line();
+            continue;
+        }
+        int from = p.first;
+        int to = p.first + p.nlines;
+        if (first || !cur.empty()) {
+            cur += E.file.line(from++);
+            end_line();
+        }
+        if (from < to) {
+            nodes.push_back(new_node(NULL, from, to - from));
+            nlines += to - from;
+        }
+    }
+    *endx = cur.size();
+    cur += tail;
+    nodes.push_back(new_node(new_owned_row(cur), 0, 1));
+    nlines++;
+
+    E.rows.insert_nodes(cy+1, nodes);
+    for (RowNode* n : nodes) {
+        if (n->row) update_row_render(n->row);
+    }
+    *endy = cy + nlines;
+}
+
+// Deletes the text from (sx, sy) up to (ex, ey) in one go and, unless
+// `out` is NULL, adds it to that clip. The start row always stays.
+void delete_range(int sx, int sy, int ex, int ey, Clip* out) {
+    if (sy == ey) {
+        std::string text = row_delete_range(E.get_row_at(sy), sx, ex-sx);
+        if (out) clip_add_text(out, std::move(text), false);
+    } else {
+        // The rows in between go in one range delete; the start row then
+        // takes what is left of the end row.
+        EditorRow* startrow = E.get_row_at(sy);
+        EditorRow* endrow = E.get_row_at(ey);
+        std::string_view head = startrow->text().substr(sx);
+        if (out) clip_add_text(out, std::string(head), true);
+        delete_rows(sy+1, ey-sy-1, out);
+        if (out) clip_add_text(out, std::string(endrow->text().substr(0, ex)), false);
+
+        std::string_view rest = endrow->text().substr(ex);
+        startrow->own().replace(sx, std::string::npos, rest);
+        update_row_edit(startrow, sx, head.size(), rest.size());
+        delete_row(sy+1);
+    }
+}
+
+// Like delete_range, but deleting all of the text leaves no rows.
+void delete_text(int sx, int sy, int ex, int ey, Clip* out) {
+    if (sx == 0 && sy == 0 && !E.has_row(ey+1) && ex == E.get_row_at(ey)->len()) {
+        delete_rows(0, E.numrows(), out);
+        if (out) clip_chop_newline(out);
+    } else {
+        delete_range(sx, sy, ex, ey, out);
+    }
+}
+
+// Drops the oldest steps until the history fits the limit, or all of
+// it if the latest step alone does not.
+void undo_trim() {
+    UndoLog* u = &E.undo;
+    while (u->bytes() > u->limit && u->steps.size() > 1 && u->done > 0) u->drop_first();
+    if (u->bytes() > u->limit) {
+        bool open = u->open;
+        u->clear();
+        u->open = open;
+        u->lost = open;
+    }
+}
+
+// One side of a delta: `clip` when it is set, else `bytes`.
+struct UndoText {
+    std::string_view bytes;
+    Clip* clip;
+
+    u64 size() {
+        return clip ? clip->size : bytes.size();
+    }
+};
+
+void undo_put_text(UndoLog* u, UndoText text) {
+    if (text.clip) {
+        u->put_varint(sizeof(Clip*) << 1 | 1);
+        u->put(&text.clip, sizeof(Clip*));
+        u->held += clip_ref(text.clip)->owned;
+    } else {
+        u->put_varint(text.bytes.size() << 1);
+        u->put(text.bytes.data(), text.bytes.size());
+    }
+}
+
+// Reads the side of a delta at *at into *text, keeping its bytes in
+// *buf.
+void undo_get_text(UndoLog* u, u64* at, UndoText* text, std::string* buf) {
+    u64 len = u->get_varint(at);
+    text->clip = NULL;
+    if (len & 1) {
+        u->get(*at, &text->clip, sizeof(Clip*));
+        text->bytes = "";
+    } else {
+        buf->resize(len >> 1);
+        u->get(*at, buf->data(), buf->size());
+        text->bytes = *buf;
+    }
+    *at += len >> 1;
+}
+
+// Appends a delta to the open step, first starting a step with the
+// cursor at (cx, cy) if there is none. A new step drops whatever was
+// undone, since it can no longer be redone.
+void undo_write(int cx, int cy, int x, int y, UndoText removed, UndoText inserted) {
+    UndoLog* u = &E.undo;
+    if (!u->open) {
+        u->truncate(u->done < u->steps.size() ? u->steps[u->done].start : u->end);
+        u->steps.resize(u->done);
+        u->steps.push_back({u->end, cx, cy});
+        u->done = u->steps.size();
+        u->open = true;
+        u->lost = false;
+    }
+    if (u->lost) return;
+    u64 cost = (removed.clip ? removed.clip->owned : removed.bytes.size())
+        + (inserted.clip ? inserted.clip->owned : inserted.bytes.size());
+    if (cost > u->limit) {
+        u->clear();
+        u->open = true;
+        u->lost = true;
+        return;
+    }
+    u->put_varint(y);
+    u->put_varint(x);
+    undo_put_text(u, removed);
+    undo_put_text(u, inserted);
+    undo_trim();
+}
+
+// Puts the pending run of typed characters into the log as a step of
+// its own.
+void undo_end_typing() {
+    UndoLog* u = &E.undo;
+    if (!u->typing) return;
+    u->typing = false;
+    u->open = u->type_join;
+    undo_write(u->type_cx, u->type_cy, u->type_x, u->type_y, {"", NULL}, {u->typed, NULL});
+    u->open = false;
+    u->typed.clear();
+}
+
+// Records that `removed` at (x, y) is about to be replaced by
+// `inserted`. Deltas recorded while handling one key make one step.
+void undo_record(int x, int y, std::string_view removed, std::string_view inserted) {
+    undo_end_typing();
+    undo_write(E.cx, E.cy, x, y, {removed, NULL}, {inserted, NULL});
+}
+
+// Like undo_record, for text held in clips, which the log then shares
+// instead of copying. Either may be NULL for no text.
+void undo_record_clip(int x, int y, Clip* removed, Clip* inserted) {
+    undo_end_typing();
+    undo_write(E.cx, E.cy, x, y, {"", removed}, {"", inserted});
+}
+
+// Records a typed character, adding it to the pending run when it
+// goes right after it.
+void undo_record_char(int x, int y, char c) {
+    UndoLog* u = &E.undo;
+    if (u->typing && y == u->type_y && x == u->type_x + (int)u->typed.size()) {
+        u->typed += c;
+        return;
+    }
+    undo_end_typing();
+    u->typing = true;
+    u->type_x = x;
+    u->type_y = y;
+    u->type_cx = E.cx;
+    u->type_cy = E.cy;
+    u->typed.assign(1, c);
+    u->type_join = u->open;
+}
+
+// Records that the empty buffer got its one empty row, or that the
+// buffer lost its last row, which was empty. Neither is a change to the
+// text, so the delta is marked by y = -1, with x = 1 if the row came.
+void undo_record_empty_row(bool added) {
+    undo_end_typing();
+    undo_write(E.cx, E.cy, added, -1, {"", NULL}, {"", NULL});
+}
+
+// Ends the step deltas are going into.
+void undo_seal() {
+    E.undo.open = false;
+}
+
+// Replaces the `from` text at (x, y) with `to` without recording it.
+// A change within a row is a single splice; otherwise `from` is deleted
+// and `to` inserted, each in one go.
+void undo_replace(int x, int y, UndoText from, UndoText to) {
+    if (!from.clip && !to.clip && from.bytes.find('\n') == std::string_view::npos && to.bytes.find('\n') == std::string_view::npos) {
+        EditorRow* row = E.get_row_at(y);
+        row->own().replace(x, from.bytes.size(), to.bytes);
+        update_row_edit(row, x, from.bytes.size(), to.bytes.size());
+        return;
+    }
+    if (from.size()) {
+        int nl, lastlen;
+        if (from.clip) {
+            nl = from.clip->nl;
+            lastlen = from.clip->lastlen;
+        } else {
+            nl = std::count(from.bytes.begin(), from.bytes.end(), '\n');
+            usize last = from.bytes.rfind('\n');
+            lastlen = last == std::string_view::npos ? from.bytes.size() : from.bytes.size() - last - 1;
+        }
+        delete_range(x, y, nl ? lastlen : x + lastlen, y + nl, NULL);
+    }
+    if (to.size()) {
+        int endx, endy;
+        if (to.clip) insert_clip(x, y, to.clip, &endx, &endy);
+        else insert_text(x, y, to.bytes, &endx, &endy);
+    }
+}
+
+// Takes step i out of the text, or puts it back in when `redo` is set.
+void undo_apply_step(usize i, bool redo) {
+    UndoLog* u = &E.undo;
+    std::vector<u64> deltas;
+    u64 end = u->step_end(i);
+    for (u64 at = u->steps[i].start; at < end;) {
+        deltas.push_back(at);
+        u->get_varint(&at);
+        u->get_varint(&at);
+        for (int k = 0; k < 2; k++) {
+            u64 len = u->get_varint(&at);
+            at += len >> 1;
+        }
+    }
+    if (!redo) std::reverse(deltas.begin(), deltas.end());
+
+    std::string rbuf, ibuf;
+    UndoText removed, inserted;
+    for (u64 at : deltas) {
+        int y = u->get_varint(&at);
+        int x = u->get_varint(&at);
+        undo_get_text(u, &at, &removed, &rbuf);
+        undo_get_text(u, &at, &inserted, &ibuf);
+        if (y < 0) {
+            if (x == redo) insert_row(0, "");
+            else delete_row(0);
+        } else if (redo) undo_replace(x, y, removed, inserted);
+        else undo_replace(x, y, inserted, removed);
+    }
+}
+
+// Puts `clip` at the front of the kill ring, which takes over the
+// reference. The oldest entries go while there are more than
+// KILL_RING_SIZE or the bytes they own come to over KILL_RING_BUDGET,
+// but the newest always stays.
+void kill_ring_push(Clip* clip) {
+    E.keylog << "[cut " << clip->size << " bytes]";
+    E.kill_ring.push_front(clip);
+    u64 owned = 0;
+    for (Clip* c : E.kill_ring) owned += c->owned;
+    while (E.kill_ring.size() > 1 && (E.kill_ring.size() > KILL_RING_SIZE || owned > KILL_RING_BUDGET)) {
+        owned -= E.kill_ring.back()->owned;
+        clip_unref(E.kill_ring.back());
+        E.kill_ring.pop_back();
+    }
+}
+
+void kill_ring_clear() {
+    for (Clip* clip : E.kill_ring) clip_unref(clip);
+    E.kill_ring.clear();
 }
 
 int row_get_indent(EditorRow* row) {
     int indent = 0;
-    while (indent < row->len() && row->data[indent] == '\t') indent++;
+    while (indent < row->len() && row->text()[indent] == '\t') indent++;
     return indent;
 }
 
 void row_set_indent(EditorRow* row, int indent) {
     int current_indent = row_get_indent(row);
+    undo_record(0, row_index(row), row->text().substr(0, current_indent), std::string(indent, '\t'));
     row_delete_range(row, 0, current_indent);
 
     for (int i = 0; i < indent; i++) {
@@ -662,10 +3608,8 @@ void set_cmdline_msg_error(const std::string& fmt, Args... args) {
 
 std::string rows_to_string() {
     std::string res;
-    for (int i = 0; i < E.numrows(); i++) {
-        res.append(E.get_row_at(i)->data);
-        res.append("\n");
-    }
+    res.reserve(nodes_text_size(E.rows.root));
+    nodes_append_text(E.rows.root, &res);
     return res;
 }
 
@@ -678,9 +3622,9 @@ void _find_synhlt_with_ext() {
     if (ext == "") return;
 
     for (usize i = 0; i < NUM_HLDBS; i++) {
-        EditorSyntax* s = &HLDB[i];
+        const EditorSyntax* s = &HLDB[i];
         int e = 0;
-        std::string need = s->extmatch[e];
+        std::string_view need = s->extmatch[e];
         while (need != "") {
             if (need == ext) {
                 E.syn = s;
@@ -694,18 +3638,25 @@ void _find_synhlt_with_ext() {
 
 void update_synhlt_from_ext() {
     _find_synhlt_with_ext();
-    for (int r = 0; r < E.numrows(); r++) {
-        update_row_syntax(E.get_row_at(r));
+    // Rows are highlighted again as they are drawn.
+    E.hl_gen++;
+    E.syn_frontier = 0;
+}
+
+// First row on screen once row `y` is scrolled into view with `rowoff`
+// on top.
+int rowoff_showing(int rowoff, int y) {
+    if (y < rowoff) {
+        return y;
+    }
+    if (y >= rowoff + (E.screenrows-5)) {
+        return y - (E.screenrows-5) + 1;
     }
+    return rowoff;
 }
 
 void scroll_to(int x, int y) {
-    if (y < E.rowoff) {
-        E.rowoff = y;
-    }
-    if (y >= E.rowoff + (E.screenrows-5)) {
-        E.rowoff = y - (E.screenrows-5) + 1;
-    }
+    E.rowoff = rowoff_showing(E.rowoff, y);
     if (x < E.coloff) {
         E.coloff = x;
     }
@@ -730,8 +3681,26 @@ void str_trim_trailing_ws(std::string& s) {
 }
 
 void file_trim_trailing_ws() {
-    for (int i = 0; i < E.numrows(); i++) {
-        str_trim_trailing_ws(E.get_row_at(i)->data);
+    std::vector<int> trim;
+    E.rows.each([&](RowNode* n, int idx) {
+        if (n->row) {
+            trim.push_back(idx);
+            return;
+        }
+        for (int i = 0; i < n->nlines; i++) {
+            std::string_view line = E.file.line(n->first + i);
+            if (line.size() && std::string_view(WHITESPACE).find(line.back()) != std::string_view::npos) {
+                trim.push_back(idx + i);
+            }
+        }
+    });
+
+    for (int i : trim) {
+        EditorRow* row = E.get_row_at(i);
+        usize end = row->text().find_last_not_of(WHITESPACE)+1;
+        if (end == (usize)row->len()) continue;
+        undo_record(end, i, row->text().substr(end), "");
+        row_truncate(row, end);
     }
 }
 
@@ -740,95 +3709,594 @@ void set_path(const std::string& path) {
     update_synhlt_from_ext();
 }
 
-void open_file(const std::string& path) {
-    std::ifstream f(path);
-    std::string line;
+// Drops the open buffer. Rows only need their strings destroyed; the
+// pools then hand their slabs back in one go.
+void close_buffer() {
+    E.loader.stop();
+    auto destroy = [](RowNode* n, int) {
+        if (n->row) n->row->~EditorRow();
+    };
+    int idx = 0;
+    node_each(E.rows.root, &idx, destroy);
+    E.rows.root = NULL;
+    row_pool.release();
+    node_pool.release();
+    hl_arena.release();
+    tab_arena.release();
+    E.undo.clear();
+    E.undo.typing = false;
+    kill_ring_clear();
+
+    if (E.file.mapped) munmap((void*)E.file.data, E.file.size);
+    E.file.data = "";
+    E.file.size = 0;
+    E.file.mapped = false;
+    E.file.linestarts.clear();
+    E.syn_frontier = 0;
+}
 
-    if (!f) core::error_exit_with_msg("file not found");
-    while (std::getline(f, line)) {
-        insert_row(E.numrows(), line);
+void open_file(const std::string& path) {
+    close_buffer();
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) core::error_exit_with_msg("file not found");
+    struct stat st;
+    if (fstat(fd, &st) == -1) core::error_exit_from("fstat");
+
+    E.file.size = st.st_size;
+    E.file.data = "";
+    E.file.mapped = false;
+    if (E.file.size != 0) {
+        void* p = mmap(NULL, E.file.size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) core::error_exit_from("mmap");
+        E.file.data = (const char*)p;
+        E.file.mapped = true;
     }
+    close(fd);
+
+    // Index enough of the file for the first screen right here and leave
+    // the rest to the loader thread.
+    E.file.linestarts.clear();
+    E.file.linestarts.push_back(0);
+    std::vector<u64> found;
+    u64 indexed = 0;
+    while (indexed < E.file.size && E.file.numlines() <= E.screenrows) {
+        u64 to = indexed + LOAD_FIRST_CHUNK_SIZE;
+        if (to > E.file.size) to = E.file.size;
+        index_lines(E.file.data, E.file.size, indexed, to, &found);
+        E.file.linestarts.append(found);
+        found.clear();
+        indexed = to;
+    }
+
+    E.rows.root = NULL;
+    if (E.file.numlines()) E.rows.append_run(0, E.file.numlines());
+    if (indexed < E.file.size) E.loader.start(&E.file, indexed);
     set_path(path);
     E.dirty = false;
 }
 
-void search_text_forward(const std::string& query, bool set_cursor_on_match) {
-    if (query == "") {
-        E.reset_hlt();
+// Bytes the kill ring holds besides the lines it shares with the file.
+u64 kill_ring_bytes() {
+    u64 bytes = 0;
+    for (Clip* clip : E.kill_ring) bytes += clip->owned;
+    return bytes;
+}
+
+usize arena_bytes(ByteArena* arena) {
+    usize bytes = arena->large_bytes;
+    for (int i = 0; i < BYTE_ARENA_CLASSES; i++) bytes += arena->classes[i].stats.slab_bytes;
+    return bytes;
+}
+
+void do_show_memstats() {
+    set_cmdline_msg_info(
+        "rows {}/{} {}K, nodes {}/{} {}K, hl {}K, tabs {}K, undo {}K, kill ring {}K (live/allocs, slab size)",
+        row_pool.stats.live,
+        row_pool.stats.allocs,
+        row_pool.stats.slab_bytes / 1024,
+        node_pool.stats.live,
+        node_pool.stats.allocs,
+        node_pool.stats.slab_bytes / 1024,
+        arena_bytes(&hl_arena) / 1024,
+        arena_bytes(&tab_arena) / 1024,
+        E.undo.bytes() / 1024,
+        kill_ring_bytes() / 1024);
+}
+
+void do_toggle_search_icase() {
+    E.search_icase = !E.search_icase;
+    set_cmdline_msg_info(E.search_icase ? "search ignores case" : "search matches case");
+}
+
+void do_toggle_search_regex() {
+    E.search_regex = !E.search_regex;
+    set_cmdline_msg_info(E.search_regex ? "search uses regular expressions" : "search uses plain text");
+}
+
+const usize SEARCH_BATCH_SIZE = 1024*1024;
+const int SEARCH_MAX_THREADS = 16;
+
+// Cuts the buffer into spans of at most about SEARCH_BATCH_SIZE bytes.
+void search_spans(std::vector<SearchSpan>* out) {
+    E.rows.each([&](RowNode* n, int idx) {
+        if (n->row) {
+            out->push_back({idx, -1, n->row->text()});
+            return;
+        }
+        int end = n->first + n->nlines;
+        for (int first = n->first; first < end;) {
+            u64 start = E.file.linestarts[first];
+            int upto = end;
+            if (E.file.linestarts[end] - start > SEARCH_BATCH_SIZE) {
+                upto = std::max(first+1, E.file.line_at(start + SEARCH_BATCH_SIZE, first, end));
+            }
+            out->push_back({idx + first - n->first, first, E.file.lines_span(first, upto - first)});
+            first = upto;
+        }
+    });
+}
+
+void search_span(SearchPattern* pat, const SearchSpan& span, std::vector<SearchMatch>* out) {
+    int line = span.line;
+    auto add = [&](usize at) {
+        if (span.line < 0) {
+            out->push_back({span.row, (u32)at});
+            return;
+        }
+        u64 pos = span.text.data() + at - E.file.data;
+        line = E.file.line_after(pos, line);
+        out->push_back({span.row + line - span.line, (u32)(pos - E.file.linestarts[line])});
+    };
+
+    if (pat->regex) {
+        static thread_local std::vector<usize> starts;
+        starts.clear();
+        regex_find_all(&pat->re, span.text, &starts);
+        for (usize at : starts) add(at);
         return;
     }
-    bool found = false;
-
-    for (int i = E.cy; i < E.numrows(); i++) {
-        EditorRow* row = E.rows[i];
-        usize match = row->rdata.find(query, (i == E.cy) ? E.rx+1 : 0);
-        if (match != std::string::npos) {
-            if (set_cursor_on_match) E.set_cpos(row_rx_to_cx(row, match), i);
-            E.hltsy = i;
-            E.hltsx = match;
-            E.hltey = i;
-            E.hltex = match + query.size();
-            scroll_to(match + query.size(), i);
-            found = true;
-            break;
+    for (usize at = find_pattern(*pat, span.text, 0); at != std::string::npos; at = find_pattern(*pat, span.text, at+1)) {
+        add(at);
+    }
+}
+
+// Cuts the buffer into spans and groups them into batches of about
+// SEARCH_BATCH_SIZE bytes. Batch b is spans [batches[b], batches[b+1]).
+void search_batches(std::vector<SearchSpan>* spans, std::vector<usize>* batches) {
+    search_spans(spans);
+    usize bytes = 0;
+    for (usize i = 0; i < spans->size(); i++) {
+        if (bytes == 0) batches->push_back(i);
+        bytes += (*spans)[i].text.size();
+        if (bytes >= SEARCH_BATCH_SIZE) bytes = 0;
+    }
+    batches->push_back(spans->size());
+}
+
+void search_batch(SearchPattern* pat, const std::vector<SearchSpan>& spans, const std::vector<usize>& batches, usize b, std::vector<SearchMatch>* out) {
+    for (usize i = batches[b]; i < batches[b+1]; i++) search_span(pat, spans[i], out);
+}
+
+// Finds every match in the buffer. The threads take batches in turn,
+// and the batches' matches are joined in order, so the list comes out
+// sorted without a merge. Each thread searches with its own copy of
+// `pat`, since a regex fills its DFA as it goes.
+void collect_matches(const SearchPattern& pat, std::vector<SearchMatch>* out) {
+    std::vector<SearchSpan> spans;
+    std::vector<usize> batches;
+    search_batches(&spans, &batches);
+    usize nbatches = batches.size()-1;
+
+    std::vector<std::vector<SearchMatch>> found(nbatches);
+    std::atomic<usize> next(0);
+    auto work = [&] {
+        SearchPattern mine = pat;
+        for (;;) {
+            usize b = next++;
+            if (b >= nbatches) break;
+            search_batch(&mine, spans, batches, b, &found[b]);
+        }
+    };
+
+    int nthreads = (int)std::thread::hardware_concurrency();
+    if (nthreads > SEARCH_MAX_THREADS) nthreads = SEARCH_MAX_THREADS;
+    if (nthreads > (int)nbatches) nthreads = (int)nbatches;
+    std::vector<std::thread> helpers;
+    for (int k = 1; k < nthreads; k++) helpers.emplace_back(work);
+    work();
+    for (std::thread& t : helpers) t.join();
+
+    out->clear();
+    for (auto& f : found) out->insert(out->end(), f.begin(), f.end());
+}
+
+// Matches of `query` in the whole buffer, found again only when the
+// query, the search options or the text changed since last time.
+// Returns NULL if the query does not compile.
+const std::vector<SearchMatch>* buffer_matches(const std::string& query) {
+    SearchMatches& m = E.matches;
+    if (m.text_gen == E.text_gen && m.query == query && m.pat.icase == E.search_icase && m.pat.regex == E.search_regex) {
+        return &m.list;
+    }
+    m.text_gen = 0;
+    std::string error = m.pat.compile(query, E.search_icase, E.search_regex);
+    if (error != "") {
+        set_cmdline_msg_error("bad pattern: {}", error);
+        return NULL;
+    }
+    E.wait_for_load();
+    collect_matches(m.pat, &m.list);
+    m.query = query;
+    m.text_gen = E.text_gen;
+    return &m.list;
+}
+
+// Length of the match at byte `at` of `line`.
+usize match_length(SearchPattern* pat, std::string_view line, usize at) {
+    if (!pat->regex) return pat->needle.size();
+    return regex_match_len(&pat->re, line, at);
+}
+
+// Draws the matches of `query` highlighted from now on.
+void highlight_search(const std::string& query) {
+    SearchHighlight& h = E.search_hl;
+    if (h.on && h.query == query && h.pat.icase == E.search_icase && h.pat.regex == E.search_regex) return;
+    h.on = h.pat.compile(query, E.search_icase, E.search_regex) == "";
+    h.query = query;
+    h.gen++;
+}
+
+void clear_search_highlight() {
+    E.search_hl.on = false;
+}
+
+// Finds the matches of the highlighted search in the row, each one
+// starting past the end of the one before, as :s replaces them.
+void update_row_found(EditorRow* row) {
+    static std::vector<usize> starts;
+    static std::vector<MatchSpan> spans;
+    SearchPattern* pat = &E.search_hl.pat;
+    std::string_view text = row->text();
+    spans.clear();
+    if (pat->regex) {
+        starts.clear();
+        regex_find_all(&pat->re, text, &starts);
+        u32 done = 0;
+        for (usize at : starts) {
+            if (at < done) continue;
+            done = at + match_length(pat, text, at);
+            spans.push_back({(u32)at, done});
         }
+    } else {
+        usize len = pat->needle.size();
+        for (usize at = find_pattern(*pat, text, 0); at != std::string::npos; at = find_pattern(*pat, text, at + len)) {
+            spans.push_back({(u32)at, (u32)(at + len)});
+        }
+    }
+
+    usize bytes = spans.size() * sizeof(MatchSpan);
+    row->found = (MatchSpan*)hl_arena.reuse((u8*)row->found, row->nfound * sizeof(MatchSpan), bytes);
+    if (bytes) memcpy(row->found, spans.data(), bytes);
+    row->nfound = spans.size();
+    row->found_gen = E.search_hl.gen;
+}
+
+void show_search_match(SearchPattern* pat, const SearchMatch& m, bool set_cursor_on_match) {
+    int y = m.row;
+    usize x = m.col;
+    usize len = match_length(pat, E.rows.text(y), x);
+    EditorRow* row = E.get_row_at(y);
+    if (set_cursor_on_match) E.set_cpos(x, y);
+    scroll_to(row_cx_to_rx(row, x + len), y);
+}
+
+// Shows what the incremental search found so far; once it is done the
+// matches are kept for b, B and Enter.
+void absorb_incremental_search() {
+    IncrementalSearch& s = E.isearch;
+    if (!s.active) return;
+    bool has_first, done;
+    SearchMatch first;
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        has_first = s.has_first;
+        first = s.first;
+        done = s.done;
     }
 
-    if (!found) {
-        set_cmdline_msg_error("search reached EOF");
-        E.reset_hlt();
+    if (has_first && !s.shown) {
+        show_search_match(&s.pat, first, false);
+        s.shown = true;
     }
+    if (!done) return;
+    s.thread.join();
+    s.active = false;
+    // Rows still to be loaded may hold a match.
+    if (!has_first && !s.partial) clear_search_highlight();
+
+    SearchMatches& m = E.matches;
+    m.list.clear();
+    for (auto& f : s.found) m.list.insert(m.list.end(), f.begin(), f.end());
+    std::vector<std::vector<SearchMatch>>().swap(s.found);
+    m.query = s.query;
+    std::swap(m.pat, s.pat);
+    // A partial list is no good for b and B.
+    m.text_gen = s.partial ? 0 : E.text_gen;
 }
 
-void search_text_backward(const std::string& query, bool set_cursor_on_match) {
+const int ISEARCH_WAIT_MS = 10;
+
+// Starts searching for the query being typed, stopping the previous
+// search. Small buffers are done before the wait is over, and show
+// the match right away. A file still loading is not waited for; the
+// search runs again once it is read (see resume_incremental_search).
+void start_incremental_search(const std::string& query) {
+    IncrementalSearch& s = E.isearch;
+    s.stop();
     if (query == "") {
-        E.reset_hlt();
+        clear_search_highlight();
         return;
     }
-    bool found = false;
-
-    for (int i = E.cy; i >= 0; i--) {
-        // If at beginning of line, then skip current line
-        if (i == E.cy && E.cx == 0) continue;
-        EditorRow* row = E.rows[i];
-        usize match = row->rdata.rfind(query, (i == E.cy) ? E.rx-1 : std::string::npos);
-        if (match != std::string::npos) {
-            if (set_cursor_on_match) E.set_cpos(row_rx_to_cx(row, match), i);
-            E.hltsy = i;
-            E.hltsx = match;
-            E.hltey = i;
-            E.hltex = match + query.size();
-            scroll_to(match + query.size(), i);
-            found = true;
-            break;
+    if (s.pat.compile(query, E.search_icase, E.search_regex) != "") {
+        clear_search_highlight();
+        return;
+    }
+    highlight_search(query);
+
+    s.query = query;
+    s.partial = E.loader.active;
+    s.cursor = {E.cy, (u32)E.cx};
+    s.spans.clear();
+    s.batches.clear();
+    search_batches(&s.spans, &s.batches);
+    s.found.assign(s.batches.size()-1, {});
+
+    // Start with the batch holding the cursor's row.
+    s.start_batch = 0;
+    if (!s.spans.empty()) {
+        usize span = std::partition_point(s.spans.begin(), s.spans.end(),
+            [](const SearchSpan& sp) { return sp.row <= E.cy; }) - s.spans.begin() - 1;
+        s.start_batch = std::partition_point(s.batches.begin(), s.batches.end()-1,
+            [span](usize first) { return first <= span; }) - s.batches.begin() - 1;
+    }
+
+    s.has_first = false;
+    s.done = false;
+    s.shown = false;
+    s.stopping = false;
+    s.active = true;
+    s.thread = std::thread(IncrementalSearch::run, &s);
+    s.wait(ISEARCH_WAIT_MS);
+    absorb_incremental_search();
+}
+
+// Searches the whole buffer for the query being typed once the file
+// is loaded, if it was only partly read when the last search started.
+void resume_incremental_search() {
+    IncrementalSearch& s = E.isearch;
+    if (E.mode != SEARCH || s.active || !s.partial || E.loader.active) return;
+    s.partial = false;
+    if (s.query == E.cmdline) start_incremental_search(s.query);
+}
+
+// `n` with commas between groups of three digits, as in 9,311.
+std::string group_digits(u64 n) {
+    std::string s = std::to_string(n);
+    for (int i = (int)s.size() - 3; i > 0; i -= 3) s.insert(i, ",");
+    return s;
+}
+
+// Moves the cursor to the next match of `query` after it, or the one
+// before it, and tells which of all the matches that is.
+void search_jump(const std::string& query, bool forward) {
+    const std::vector<SearchMatch>* matches = buffer_matches(query);
+    if (!matches) {
+        clear_search_highlight();
+        return;
+    }
+    const std::vector<SearchMatch>& list = *matches;
+    if (list.empty()) {
+        set_cmdline_msg_error("pattern not found: {}", query);
+        clear_search_highlight();
+        return;
+    }
+    highlight_search(query);
+
+    SearchMatch cur = {E.cy, (u32)E.cx};
+    usize i;
+    bool wrapped = false;
+    if (forward) {
+        i = std::upper_bound(list.begin(), list.end(), cur) - list.begin();
+        wrapped = i == list.size();
+        if (wrapped) i = 0;
+    } else {
+        i = std::lower_bound(list.begin(), list.end(), cur) - list.begin();
+        wrapped = i == 0;
+        i = (wrapped ? list.size() : i) - 1;
+    }
+
+    show_search_match(&E.matches.pat, list[i], true);
+    if (wrapped) {
+        set_cmdline_msg_info("match {}/{}, wrapped to {}", group_digits(i+1), group_digits(list.size()), forward ? "top" : "bottom");
+    } else {
+        set_cmdline_msg_info("match {}/{}", group_digits(i+1), group_digits(list.size()));
+    }
+}
+
+// Splits the `/pattern/replacement/` of a substitute command; the last
+// slash may be left out. `\/` stands for a slash in either part. Other
+// escapes in the pattern are kept for the regex, and in the
+// replacement `\\` is a backslash.
+bool parse_substitute(std::string_view arg, std::string* pattern, std::string* replacement) {
+    if (arg.empty() || arg[0] != '/') return false;
+    usize i = 1;
+    auto part = [&](std::string* out, bool in_pattern) {
+        while (i < arg.size() && arg[i] != '/') {
+            if (arg[i] == '\\' && i+1 < arg.size()) {
+                char c = arg[i+1];
+                if (c != '/' && (in_pattern || c != '\\')) out->push_back('\\');
+                out->push_back(c);
+                i += 2;
+                continue;
+            }
+            out->push_back(arg[i++]);
         }
+    };
+    part(pattern, true);
+    if (i == arg.size()) return false;
+    i++;
+    part(replacement, false);
+    return i >= arg.size()-1;
+}
+
+// Writes into *out the text of the row that list[*i] is in, with each
+// of its matches from there on replaced, and moves *i past them.
+// Matches overlapping one already replaced are skipped. Returns how
+// many were replaced.
+usize substitute_row(SearchPattern* pat, std::string_view text, const std::vector<SearchMatch>& list, usize* i, std::string_view replacement, std::string* out) {
+    int row = list[*i].row;
+    usize done = 0;
+    usize n = 0;
+    out->clear();
+    for (; *i < list.size() && list[*i].row == row; (*i)++) {
+        usize at = list[*i].col;
+        if (at < done) continue;
+        out->append(text.substr(done, at - done));
+        usize len = match_length(pat, text, at);
+        undo_record(out->size(), row, text.substr(at, len), replacement);
+        out->append(replacement);
+        done = at + len;
+        n++;
+    }
+    out->append(text.substr(done));
+    return n;
+}
+
+// Replaces every match in the buffer as a single edit. Each changed
+// row gets its new text built and its tabs indexed once, and lines
+// still in the file block become rows through one rebuild of the row
+// tree rather than being split out one by one. Highlighting is only
+// redone for the changed rows, as they are drawn.
+void do_substitute(std::string_view arg) {
+    std::string pattern, replacement;
+    if (!parse_substitute(arg, &pattern, &replacement)) {
+        set_cmdline_msg_error("usage: s/pattern/replacement/");
+        return;
+    }
+    if (pattern == "") pattern = E.search_default;
+    if (pattern == "") {
+        set_cmdline_msg_error("empty prev search");
+        return;
+    }
+    const std::vector<SearchMatch>* matches = buffer_matches(pattern);
+    if (!matches) return;
+    const std::vector<SearchMatch>& list = *matches;
+    if (list.empty()) {
+        set_cmdline_msg_error("pattern not found: {}", pattern);
+        return;
     }
 
-    if (!found) {
-        set_cmdline_msg_error("search reached BOF");
-        E.reset_hlt();
+    SearchPattern* pat = &E.matches.pat;
+    std::vector<RowNode*> old;
+    E.rows.each([&](RowNode* n, int) { old.push_back(n); });
+    std::vector<RowNode*> nodes;
+    nodes.reserve(old.size());
+    std::string text;
+    usize i = 0;
+    usize replaced = 0;
+    int changed = 0;
+    int idx = 0;
+    for (RowNode* n : old) {
+        int first = idx;
+        idx += n->nlines;
+        if (i == list.size() || list[i].row >= idx) {
+            nodes.push_back(n);
+            continue;
+        }
+        if (n->row) {
+            replaced += substitute_row(pat, n->row->text(), list, &i, replacement, &text);
+            n->row->data.swap(text);
+            n->row->owned = true;
+            update_row_render(n->row);
+            nodes.push_back(n);
+            changed++;
+            continue;
+        }
+
+        // The lines of a run that have matches become rows of their own,
+        // and the lines between them stay runs.
+        int at = first;
+        while (i < list.size() && list[i].row < idx) {
+            int y = list[i].row;
+            if (y > at) nodes.push_back(new_node(NULL, n->first + at - first, y - at));
+            replaced += substitute_row(pat, E.file.line(n->first + y - first), list, &i, replacement, &text);
+            EditorRow* row = new_owned_row(text);
+            update_row_render(row);
+            nodes.push_back(new_node(row, 0, 1));
+            changed++;
+            at = y+1;
+        }
+        if (at < idx) nodes.push_back(new_node(NULL, n->first + at - first, idx - at));
+        node_pool.free(n);
     }
+    for (RowNode* n : nodes) {
+        n->left = NULL;
+        n->right = NULL;
+    }
+    E.rows.set_root(node_build(nodes));
+    E.mark_dirty();
+    syntax_invalidate_from(list[0].row);
+    // The matches are all stale now.
+    std::vector<SearchMatch>().swap(E.matches.list);
+
+    clear_search_highlight();
+    E.set_cpos(std::min(E.cx, E.get_row_at(E.cy)->len()), E.cy);
+    set_cmdline_msg_info("replaced {} matches on {} lines", replaced, changed);
 }
 
 // =========== high level ==============
-void ewrite(const std::string& str) {
-    E.abuf.append(str);
+// The ewrite* functions put text into E.frame at the pen, in the pen's
+// face. Anything past the right edge is dropped.
+void ewrite_cstr_with_len(const char* str, usize len) {
+    if (E.pen_y >= E.frame.rows || E.pen_x >= E.frame.cols) return;
+    usize n = std::min(len, (usize)(E.frame.cols - E.pen_x));
+    memcpy(E.frame.chars_at(E.pen_y) + E.pen_x, str, n);
+    memset(E.frame.faces_at(E.pen_y) + E.pen_x, E.pen, n);
+    E.pen_x += n;
+}
+
+void ewrite(std::string_view str) {
+    ewrite_cstr_with_len(str.data(), str.size());
 }
 
 void ewrite_char(char c) {
-    E.abuf += c;
+    ewrite_cstr_with_len(&c, 1);
 }
 
-void ewrite_cstr_with_len(const char* str, usize len) {
-    E.abuf.append(str, len);
+void ewrite_with_len(std::string_view str, usize len) {
+    ewrite_cstr_with_len(str.data(), std::min(len, str.size()));
+}
+
+void enewline() {
+    E.pen_y++;
+    E.pen_x = 0;
+}
+
+void eclear_eol() {
+    if (E.pen_y >= E.frame.rows || E.pen_x >= E.frame.cols) return;
+    usize n = E.frame.cols - E.pen_x;
+    memset(E.frame.chars_at(E.pen_y) + E.pen_x, ' ', n);
+    memset(E.frame.faces_at(E.pen_y) + E.pen_x, HL_NORMAL, n);
 }
 
-void ewrite_with_len(const std::string& str, usize len) {
-    E.abuf.append(str, 0, len);
+void epen_reset() {
+    E.pen = HL_NORMAL;
 }
 
 void insert_empty_row_if_file_empty() {
     if (E.numrows() == 0) {
+        undo_record_empty_row(true);
         insert_row(E.numrows(), "");
     }
 }
@@ -844,7 +4312,8 @@ void row_indent_to_prev_indent(EditorRow* row_to_indent) {
         int cx = row->len();
 
         for (; cx >= 0; cx--) {
-            if (row->data[cx] != '\t' && row->data[cx] != ' ') {
+            char c = cx < row->len() ? row->text()[cx] : '\0';
+            if (c != '\t' && c != ' ') {
                 target_indent = row_get_indent(row);
                 found_indent = true;
                 break;
@@ -864,6 +4333,7 @@ void row_indent_to_prev_indent(EditorRow* row_to_indent) {
 void delete_empty_row_if_file_empty() {
     EditorRow* row = E.get_row_at(E.cy);
     if (E.numrows() == 1 && row->len() == 0) {
+        undo_record_empty_row(false);
         delete_row(0);
     }
 }
@@ -881,36 +4351,78 @@ void update_cx_when_cy_changed() {
     }
 }
 
-void copy_to_clipboard(const std::string& text) {
-    E.keylog << "[start]" << text << "[end]";
-    E.clipboard = text;
-}
-
 // ============= ACTIONS ==============
 
-void do_cursor_up() {
-    if (E.cy != 0) E.cy--;
+// Motions that take a count work out where `count` steps end up and
+// move there once, rather than stepping.
+
+void do_cursor_up(int count) {
+    E.cy = std::max(E.cy - count, 0);
     update_cx_when_cy_changed();
 }
 
-void do_cursor_down() {
-    if (E.cy < E.lastrow_idx()) E.cy++;
+void do_cursor_down(int count) {
+    int target = E.cy + count;
+    E.cy = E.has_row(target) ? target : std::max(E.lastrow_idx(), E.cy);
     update_cx_when_cy_changed();
 }
 
-void do_cursor_left() {
-    if (E.cx != 0) E.set_cpos(E.cx-1, E.cy);
-    else if (E.cy > 0) {
-        E.set_cpos(E.get_row_at(E.cy-1)->len(), E.cy-1);
+void do_cursor_left(int count) {
+    int x = E.cx, y = E.cy;
+    while (count > 0) {
+        if (x > 0) {
+            int step = std::min(count, x);
+            x -= step;
+            count -= step;
+        } else if (y > 0) {
+            y--;
+            x = E.rows.text(y).size();
+            count--;
+        } else break;
     }
+    E.set_cpos(x, y);
 }
 
-void do_cursor_right() {
-    EditorRow* row = E.get_row_at(E.cy);
-    if (E.cx < row->len()) E.set_cpos(E.cx+1, E.cy);
-    else if (E.cy != (E.lastrow_idx()) && E.cx == row->len()) {
-        E.set_cpos(0, E.cy+1);
+void do_cursor_right(int count) {
+    if (E.numrows() == 0) return;
+    int x = E.cx, y = E.cy;
+    int len = E.rows.text(y).size();
+    while (count > 0) {
+        if (x < len) {
+            int step = std::min(count, len - x);
+            x += step;
+            count -= step;
+        } else if (E.has_row(y+1)) {
+            y++;
+            x = 0;
+            len = E.rows.text(y).size();
+            count--;
+        } else break;
+    }
+    E.set_cpos(x, y);
+}
+
+// A page down puts the cursor on the last row of the next screen, and
+// a page up on the first row of the previous one. Each further page
+// starts from where the screen would have scrolled to.
+void do_page_down(int count) {
+    if (E.numrows() == 0) return;
+    int rowoff = E.rowoff;
+    for (; count > 0; count--) {
+        int target = rowoff + 2*E.screenrows - 1;
+        if (!E.has_row(target)) {
+            E.cy = E.lastrow_idx();
+            break;
+        }
+        E.cy = target;
+        rowoff = rowoff_showing(rowoff, target);
     }
+    update_cx_when_cy_changed();
+}
+
+void do_page_up(int count) {
+    E.cy = (int)std::max<long>(E.rowoff - (long)count * E.screenrows, 0);
+    update_cx_when_cy_changed();
 }
 
 void do_cursor_line_begin() {
@@ -931,6 +4443,11 @@ void change_mode(EditorMode mode) {
 }
 
 void do_change_mode_to_normal() {
+    undo_end_typing();
+    if (E.mode == SEARCH) {
+        absorb_incremental_search();
+        E.isearch.stop();
+    }
     change_mode(NORMAL);
 }
 
@@ -975,62 +4492,88 @@ void do_cut_cursor_mark_region() {
         } else return;
     }
 
-    std::string copy;
-    if (startx == 0 && starty == 0 && endy == E.lastrow_idx() && endx == E.get_row_at(E.lastrow_idx())->len()) {
-        int numrows = E.numrows();
-        for (int i = 0; i < numrows; i++) {
-            if (i != 0) copy += '\n';
-            copy += delete_row(0);
-        }
-    } else if (starty == endy) {
-        copy += row_delete_range(E.get_row_at(starty), startx, endx-startx);
-    } else {
-        EditorRow* startrow = E.get_row_at(starty);
-        EditorRow* endrow = E.get_row_at(endy);
-        bool startrow_deleted = false;
+    Clip* clip = new_clip();
+    delete_text(startx, starty, endx, endy, clip);
+    undo_record_clip(startx, starty, clip, NULL);
+    if (E.numrows() == 0) undo_record_empty_row(false);
 
-        if (startx == 0) {
-            copy += delete_row(starty);
-            startrow_deleted = true;
-        } else {
-            copy += row_delete_range(startrow, startx, startrow->len()-startx);
-        }
+    E.set_cpos(startx, starty);
+    kill_ring_push(clip);
+}
 
-        for (int i = starty+1; i < endy; i++) {
-            copy += '\n';
-            copy += delete_row(startrow_deleted ? starty : starty+1);
+// Motions scan the raw bytes of the rows they cross and set the cursor
+// once at the end.
+
+// Moves to just past the end of the next word.
+void do_cursor_forward_word(int count) {
+    if (E.numrows() == 0) return;
+    int y = E.cy;
+    usize x = E.cx;
+    std::string_view text = E.rows.text(y);
+    while (count--) {
+        // Skip what is not a word, line breaks included, then the word.
+        for (;;) {
+            x = skip_class(text, x, BYTE_ALPHA, false);
+            if (x < text.size() || !E.has_row(y+1)) break;
+            y++;
+            x = 0;
+            text = E.rows.text(y);
         }
+        x = skip_class(text, x, BYTE_ALPHA, true);
+    }
+    E.set_cpos(x, y);
+}
 
-        copy += '\n';
-        if (startrow_deleted) {
-            copy += row_delete_range(endrow, 0, endx);
-        } else {
-            row_append_string(
-                startrow,
-                row_delete_range(endrow, endx, endrow->len()-endx));
-            copy += delete_row(starty+1);
+// Moves to the start of the previous word.
+void do_cursor_backward_word(int count) {
+    if (E.numrows() == 0) return;
+    int y = E.cy;
+    usize x = E.cx;
+    std::string_view text = E.rows.text(y);
+    while (count--) {
+        for (;;) {
+            x = skip_class_back(text, x, BYTE_ALPHA, false);
+            if (x > 0 || y == 0) break;
+            y--;
+            text = E.rows.text(y);
+            x = text.size();
         }
+        x = skip_class_back(text, x, BYTE_ALPHA, true);
     }
+    E.set_cpos(x, y);
+}
 
-    E.set_cpos(startx, starty);
-    copy_to_clipboard(copy);
+// Whether row `at` holds nothing but spaces and tabs.
+bool row_is_blank(int at) {
+    std::string_view text = E.rows.text(at);
+    return skip_class(text, 0, BYTE_BLANK, true) == text.size();
 }
 
-void do_cursor_forward_word() {
-    while (!isalpha(E.get_char_at_cpos()) && !E.is_cpos_at_end())
-        do_cursor_right();
-    if (!E.is_cpos_at_end()) {
-        while (isalpha(E.get_char_at_cpos())) do_cursor_right();
+// Moves to the first blank row after the next run of non-blank rows,
+// or to the end of the file.
+void do_cursor_forward_paragraph(int count) {
+    if (E.numrows() == 0) return;
+    int y = E.cy;
+    while (count-- && E.has_row(y)) {
+        y++;
+        while (E.has_row(y) && row_is_blank(y)) y++;
+        while (E.has_row(y) && !row_is_blank(y)) y++;
     }
+    if (E.has_row(y)) E.set_cpos(0, y);
+    else E.set_cpos(E.rows.text(E.lastrow_idx()).size(), E.lastrow_idx());
 }
 
-void do_cursor_backward_word() {
-    if (E.cx == 0 && E.cy == 0) return;
-    while (!(isalpha(E.get_char_at_lpos()) || E.get_char_at_lpos() == '\0'))
-        do_cursor_left();
-    while (isalpha(E.get_char_at_lpos())) {
-        do_cursor_left();
+// Moves to the last blank row before the previous run of non-blank
+// rows, or to the start of the file.
+void do_cursor_backward_paragraph(int count) {
+    if (E.numrows() == 0) return;
+    int y = E.cy;
+    while (count-- && y >= 0) {
+        y--;
+        while (y >= 0 && row_is_blank(y)) y--;
+        while (y >= 0 && !row_is_blank(y)) y--;
     }
+    E.set_cpos(0, y < 0 ? 0 : y);
 }
 
 void do_cursor_first_row() {
@@ -1039,20 +4582,41 @@ void do_cursor_first_row() {
 }
 
 void do_cursor_last_row() {
+    E.wait_for_load();
     E.cy = E.lastrow_idx();
     update_cx_when_cy_changed();
 }
 
+// Only waits for the loader to reach the line; past the end of the
+// file we land on the last row.
+void do_cursor_to_line(int line) {
+    if (!E.has_row(line-1)) line = E.numrows();
+    if (line == 0) return;
+    E.cy = line-1;
+    update_cx_when_cy_changed();
+}
+
+void do_goto_line(const std::string& arg) {
+    char* end;
+    long line = strtol(arg.c_str(), &end, 10);
+    if (arg == "" || *end != '\0' || line < 1) {
+        set_cmdline_msg_error("invalid line number '{}'", arg);
+        return;
+    }
+    if (line > INT32_MAX) line = INT32_MAX;
+    do_cursor_to_line(line);
+}
+
 void do_insert_newline(bool autoindent) {
     insert_empty_row_if_file_empty();
+    undo_record(E.cx, E.cy, "", "\n");
 
     if (E.cx == 0) {
         insert_row(E.cy, "");
     } else {
         EditorRow* row = E.get_row_at(E.cy);
-        insert_row(E.cy+1, row->data.substr(E.cx, row->len()-E.cx));
-        row->data = row->data.substr(0, E.cx);
-        update_row(row);
+        insert_row(E.cy+1, row->text().substr(E.cx));
+        row_truncate(row, E.cx);
     }
     E.set_cpos(0, E.cy+1);
     if (autoindent) row_indent_to_prev_indent(E.get_row_at(E.cy));
@@ -1069,6 +4633,7 @@ void do_insert_char(int c) {
 
     insert_empty_row_if_file_empty();
 
+    undo_record_char(E.cx, E.cy, c);
     row_insert_char(E.get_row_at(E.cy), E.cx, c);
     E.set_cpos(E.cx+1, E.cy);
 }
@@ -1078,11 +4643,13 @@ void do_delete_left_char() {
     EditorRow* row = E.get_row_at(E.cy);
 
     if (E.cx > 0) {
+        undo_record(E.cx-1, E.cy, row->text().substr(E.cx-1, 1), "");
         row_delete_range(row, E.cx-1, 1);
         E.set_cpos(E.cx-1, E.cy);
     } else {
+        undo_record(E.get_row_at(E.cy-1)->len(), E.cy-1, "\n", "");
         E.set_cpos(E.get_row_at(E.cy-1)->len(), E.cy-1);
-        row_append_string(E.get_row_at(E.cy), row->data);
+        row_append_string(E.get_row_at(E.cy), row->text());
         delete_row(E.cy+1);
     }
 
@@ -1094,33 +4661,97 @@ void do_delete_current_char() {
     if (!row) return;
 
     if (E.cx == row->len()) {
-        if (E.cy < E.lastrow_idx()) {
-            row_append_string(row, E.get_row_at(E.cy+1)->data);
+        if (E.has_row(E.cy+1)) {
+            undo_record(E.cx, E.cy, "\n", "");
+            row_append_string(row, E.get_row_at(E.cy+1)->text());
             delete_row(E.cy+1);
         }
     } else {
+        undo_record(E.cx, E.cy, row->text().substr(E.cx, 1), "");
         row_delete_range(row, E.cx, 1);
     }
 
     delete_empty_row_if_file_empty();
 }
 
-void do_paste_from_clipboard() {
-    const std::string& clip = E.clipboard;
-    usize sz = clip.size();
-    for (usize i = 0; i < sz; i++) {
-        do_insert_char(clip[i]);
+// Pastes the n-th newest entry of the kill ring.
+void do_paste_from_clipboard(int n) {
+    if (E.kill_ring.empty()) return;
+    if (n > (int)E.kill_ring.size()) {
+        set_cmdline_msg_error("kill ring holds {} entries", E.kill_ring.size());
+        return;
     }
+    Clip* clip = E.kill_ring[n-1];
+    if (clip->size == 0) return;
+    insert_empty_row_if_file_empty();
+
+    undo_record_clip(E.cx, E.cy, NULL, clip);
+    int endx, endy;
+    insert_clip(E.cx, E.cy, clip, &endx, &endy);
+    E.set_cpos(endx, endy);
 }
 
 void do_open_line_below_cursor() {
+    undo_record(E.get_row_at(E.cy)->len(), E.cy, "", "\n");
     insert_row(E.cy+1, "");
     E.set_cpos(0, E.cy+1);
     row_indent_to_prev_indent(E.get_row_at(E.cy));
     do_change_mode_to_insert();
 }
 
+// Steps back through the history `count` times, putting the cursor
+// where it was before each change.
+void do_undo(int count) {
+    undo_end_typing();
+    undo_seal();
+    if (E.undo.done == 0) {
+        set_cmdline_msg_error("nothing to undo");
+        return;
+    }
+    while (count-- && E.undo.done) {
+        E.undo.done--;
+        undo_apply_step(E.undo.done, false);
+        UndoStep* step = &E.undo.steps[E.undo.done];
+        E.set_cpos(step->cx, step->cy);
+    }
+}
+
+void do_redo(int count) {
+    undo_end_typing();
+    undo_seal();
+    if (E.undo.done == E.undo.steps.size()) {
+        set_cmdline_msg_error("nothing to redo");
+        return;
+    }
+    while (count-- && E.undo.done < E.undo.steps.size()) {
+        undo_apply_step(E.undo.done, true);
+        // Where the cursor was before the change may be gone now; where
+        // the change starts is not.
+        u64 at = E.undo.steps[E.undo.done].start;
+        int y = E.undo.get_varint(&at);
+        int x = E.undo.get_varint(&at);
+        if (y < 0) x = y = 0;
+        E.set_cpos(x, y);
+        E.undo.done++;
+    }
+}
+
+void do_set_undo_limit(const std::string& arg) {
+    char* end;
+    long mb = strtol(arg.c_str(), &end, 10);
+    if (arg == "" || *end != '\0' || mb < 0) {
+        set_cmdline_msg_error("invalid undo limit '{}'", arg);
+        return;
+    }
+    undo_end_typing();
+    undo_seal();
+    E.undo.limit = (usize)mb * 1024 * 1024;
+    undo_trim();
+    set_cmdline_msg_info("undo history limited to {} MB", mb);
+}
+
 void do_save_file() {
+    E.wait_for_load();
     file_trim_trailing_ws();
 
     if (E.path == "") {
@@ -1159,57 +4790,57 @@ void do_after_action() {
 
     if (!E.skip_after_action) {
         E.quit_times = NUM_FORCE_QUIT_PRESS;
-        E.reset_hlt();
     }
     E.skip_after_action = false;
 }
 
 void process_keypress() {
     int c = read_key();
+    if (c == NO_KEY) return;
+    undo_seal();
     if (E.mode == NORMAL) {
+        // A count starts with a non-zero digit and goes to the next
+        // command.
+        if (c >= '0' && c <= '9' && (c != '0' || E.count)) {
+            E.count = std::min(E.count*10 + (c-'0'), COUNT_MAX);
+            return;
+        }
+        bool has_count = E.count != 0;
+        int count = has_count ? E.count : 1;
+        E.count = 0;
+
         switch (c) {
             case 'i': do_change_mode_to_insert(); break;
             case 'w': do_delete_current_char(); break;
             case '`': do_exit_editor(); break;
-            case CTRL_KEY('f'):
-            case CTRL_KEY('r'): {
-                if (c == CTRL_KEY('r')) {
-                    E.cy = E.rowoff;
-                } else if (c == CTRL_KEY('f')) {
-                    E.cy = E.rowoff + E.screenrows - 1;
-                    if (E.cy > E.lastrow_idx()) {
-                        E.cy = E.lastrow_idx();
-                    }
-                }
-                update_cx_when_cy_changed();
-
-                int times = E.screenrows;
-                while (times--)
-                    if (c == CTRL_KEY('r')) do_cursor_up();
-                    else do_cursor_down();
-            } break;
+            case CTRL_KEY('f'): do_page_down(count); break;
+            case CTRL_KEY('r'): do_page_up(count); break;
             case 'a': do_cursor_line_begin(); break;
             case ';': do_cursor_line_end(); break;
-            case ARROW_LEFT:  do_cursor_left(); break;
-            case ARROW_RIGHT: do_cursor_right(); break;
-            case ARROW_UP:    do_cursor_up(); break;
-            case ARROW_DOWN:  do_cursor_down(); break;
-            case 'h': do_cursor_left(); break;
-            case 'l': do_cursor_right(); break;
-            case 'k': do_cursor_up(); break;
-            case 'j': do_cursor_down(); break;
-            case 'o': do_cursor_forward_word(); break;
-            case 'n': do_cursor_backward_word(); break;
+            case ARROW_LEFT:  do_cursor_left(count); break;
+            case ARROW_RIGHT: do_cursor_right(count); break;
+            case ARROW_UP:    do_cursor_up(count); break;
+            case ARROW_DOWN:  do_cursor_down(count); break;
+            case 'h': do_cursor_left(count); break;
+            case 'l': do_cursor_right(count); break;
+            case 'k': do_cursor_up(count); break;
+            case 'j': do_cursor_down(count); break;
+            case 'o': do_cursor_forward_word(count); break;
+            case 'n': do_cursor_backward_word(count); break;
+            case '}': do_cursor_forward_paragraph(count); break;
+            case '{': do_cursor_backward_paragraph(count); break;
             case ',': do_open_line_below_cursor(); break;
             case 'd': do_set_mark(); break;
             case 'f': do_cut_cursor_mark_region(); break;
-            case 'c': do_paste_from_clipboard(); break;
+            case 'c': do_paste_from_clipboard(count); break;
+            case 'u': do_undo(count); break;
+            case 'U': do_redo(count); break;
 
             case 'b': {
                 if (E.search_default == "") {
                     set_cmdline_msg_error("empty prev search");
                 } else {
-                    search_text_forward(E.search_default, true);
+                    search_jump(E.search_default, true);
                 }
             } break;
 
@@ -1217,7 +4848,7 @@ void process_keypress() {
                 if (E.search_default == "") {
                     set_cmdline_msg_error("empty prev search");
                 } else {
-                    search_text_backward(E.search_default, true);
+                    search_jump(E.search_default, false);
                 }
             } break;
 
@@ -1226,16 +4857,22 @@ void process_keypress() {
             case '/': do_change_mode_to_search(); break;
             case BACKSPACE: break;
             case '\r': break;
-            case '\x1b': break;
+            case '\x1b': clear_search_highlight(); break;
             case 'g': {
-                c = read_key();
+                do c = read_key(); while (c == NO_KEY);
                 switch (c) {
-                    case 'g': do_cursor_first_row(); break;
+                    case 'g':
+                        if (has_count) do_cursor_to_line(count);
+                        else do_cursor_first_row();
+                        break;
                     case '\x1b': break;
                     default: set_cmdline_msg_error("invalid key 'g {}' in normal mode", (int)c);
                 }
             } break;
-            case 'G': do_cursor_last_row(); break;
+            case 'G':
+                if (has_count) do_cursor_to_line(count);
+                else do_cursor_last_row();
+                break;
             default: set_cmdline_msg_error("invalid key '{}' in normal mode", (int)c);
         }
 
@@ -1244,10 +4881,10 @@ void process_keypress() {
             case BACKSPACE: do_delete_left_char(); break;
             case '\r':      do_insert_newline(true); break;
             case '\t':      do_insert_char(c); break;
-            case ARROW_LEFT:  do_cursor_left(); break;
-            case ARROW_RIGHT: do_cursor_right(); break;
-            case ARROW_UP:    do_cursor_up(); break;
-            case ARROW_DOWN:  do_cursor_down(); break;
+            case ARROW_LEFT:  do_cursor_left(1); break;
+            case ARROW_RIGHT: do_cursor_right(1); break;
+            case ARROW_UP:    do_cursor_up(1); break;
+            case ARROW_DOWN:  do_cursor_down(1); break;
             case '\x1b': do_change_mode_to_normal(); break;
             default: {
                 if (is_char_printable(c)) do_insert_char(c);
@@ -1268,10 +4905,21 @@ void process_keypress() {
                     else if (str_startswith(txt, "path")) {
                         set_path(txt.substr(5));
                     }
+                    else if (str_startswith(txt, "goto ")) {
+                        do_goto_line(txt.substr(5));
+                    }
+                    else if (txt == "memstats") do_show_memstats();
+                    else if (str_startswith(txt, "undolimit ")) {
+                        do_set_undo_limit(txt.substr(10));
+                    }
+                    else if (txt == "icase") do_toggle_search_icase();
+                    else if (txt == "regex") do_toggle_search_regex();
+                    else if (str_startswith(txt, "s/")) do_substitute(std::string_view(txt).substr(1));
                     else set_cmdline_msg_error("unknown command '{}'", txt);
                 } else if (mode == SEARCH) {
                     E.search_default = txt;
-                    search_text_forward(txt, true);
+                    if (txt == "") clear_search_highlight();
+                    else search_jump(txt, true);
                 }
             } break;
 
@@ -1284,7 +4932,7 @@ void process_keypress() {
                 }
 
                 if (E.mode == SEARCH) {
-                    search_text_forward(E.cmdline, false);
+                    start_incremental_search(E.cmdline);
                 }
             } break;
 
@@ -1301,6 +4949,7 @@ void process_keypress() {
 
             case '\x1b': {
                 E.skip_after_action = false;
+                if (E.mode == SEARCH) clear_search_highlight();
                 do_change_mode_to_normal();
             } break;
 
@@ -1311,7 +4960,7 @@ void process_keypress() {
                 }
 
                 if (E.mode == SEARCH) {
-                    search_text_forward(E.cmdline, false);
+                    start_incremental_search(E.cmdline);
                 }
             } break;
         }
@@ -1327,12 +4976,99 @@ void update_rx() {
     }
 }
 
+// Reads the highlight classes of a row's bytes left to right, moving
+// from chunk to chunk on long rows.
+struct HlReader {
+    EditorRow* row;
+    u32 chunk;
+    const HlSpan* spans;
+    u32 nspans;
+    // Offset the spans are relative to and where they stop applying.
+    u32 base;
+    u32 limit;
+    u32 k;
+
+    void load(u32 c) {
+        chunk = c;
+        spans = row->chunks[c].hl;
+        nspans = row->chunks[c].nhl;
+        base = row->chunks[c].from.pos;
+        limit = (c+1 < row->nchunks) ? row->chunks[c+1].from.pos : row->len();
+        k = 0;
+    }
+
+    // Starts reading at byte `cx`.
+    void seek(EditorRow* r, u32 cx) {
+        row = r;
+        if (row->nchunks) {
+            HlChunk* end = row->chunks + row->nchunks;
+            load(std::partition_point(row->chunks, end, [&](const HlChunk& c) {
+                return c.from.pos <= cx;
+            }) - row->chunks - 1);
+        } else {
+            chunk = 0;
+            spans = row->hl;
+            nspans = row->nhl;
+            base = 0;
+            limit = row->len();
+        }
+        k = std::partition_point(spans, spans + nspans, [&](const HlSpan& s) {
+            return s.start + s.len <= cx - base;
+        }) - spans;
+    }
+
+    // Class of byte `cx`, which must not be left of the last one asked
+    // about, and in *end the byte where that class stops.
+    u8 kind_at(u32 cx, int* end) {
+        while (cx >= limit && chunk+1 < row->nchunks) load(chunk+1);
+        u32 rel = cx - base;
+        while (k < nspans && spans[k].start + spans[k].len <= rel) k++;
+        if (k < nspans && spans[k].start <= rel) {
+            *end = base + spans[k].start + spans[k].len;
+            return spans[k].hl;
+        }
+        *end = (k < nspans) ? base + spans[k].start : limit;
+        return HL_NORMAL;
+    }
+};
+
+// Reads which bytes of a row are under a search match, left to right.
+struct MatchReader {
+    const MatchSpan* spans;
+    u32 nspans;
+    u32 k;
+
+    // Starts reading at byte `cx`. Nothing is under a match while the
+    // search highlight is off.
+    void seek(EditorRow* row, u32 cx) {
+        spans = row->found;
+        nspans = E.search_hl.on ? row->nfound : 0;
+        k = std::partition_point(spans, spans + nspans, [&](const MatchSpan& s) {
+            return s.end <= cx;
+        }) - spans;
+    }
+
+    // Whether byte `cx`, which must not be left of the last one asked
+    // about, is under a match, and in *end the byte where that changes.
+    bool at(u32 cx, int* end) {
+        while (k < nspans && spans[k].end <= cx) k++;
+        if (k < nspans && spans[k].start <= cx) {
+            *end = spans[k].end;
+            return true;
+        }
+        *end = (k < nspans) ? spans[k].start : INT32_MAX;
+        return false;
+    }
+};
+
 void draw_rows() {
+    syntax_update_rows(E.rowoff, E.rowoff + E.screenrows);
     for (int y = 0; y < E.screenrows; y++) {
         int filerow = y + E.rowoff;
+        epen_reset();
         if (filerow >= E.numrows()) {
-            if (E.numrows() == 0 && y == E.screenrows / 3) {
-                std::string welcome = "hed editor -- maintained by shkhuz";
+            if (E.numrows() == 0 && !E.loader.active && y == E.screenrows / 3) {
+                std::string_view welcome = "hed editor -- maintained by shkhuz";
                 usize len = welcome.size();
                 if (len > (usize)E.screencols) len = E.screencols;
 
@@ -1352,89 +5088,108 @@ void draw_rows() {
             }
 
         } else {
-            int rowlen = E.get_row_at(filerow)->rlen - E.coloff;
-            if (rowlen < 0) rowlen = 0;
-            if (rowlen > E.screencols) rowlen = E.screencols;
-
-            char* c = &E.get_row_at(filerow)->rdata.data()[E.coloff];
-            u8* hl = &E.get_row_at(filerow)->hl[E.coloff];
-            int current_color = -1;
-
-            // We go till i == rowlen because hlt end is exclusive
-            // so we need to one after the last character to check if
-            // hlt is ended.
-            // But we exit early before printing because there is
-            // no character at i == rowlen.
-            for (int i = 0; i <= rowlen; i++) {
-                int filei = i + E.coloff;
-                if (filerow == E.hltsy && filei == E.hltsx) {
-                    ewrite("\x1b[44m");
-                }
-                if (filerow == E.hltey && filei == E.hltex) {
-                    ewrite("\x1b[49m");
+            EditorRow* row = E.get_row_at(filerow);
+            std::string_view text = row->text();
+            int len = text.size();
+            if (E.search_hl.on && row->found_gen != E.search_hl.gen) update_row_found(row);
+
+            // Start at the byte under the left edge; only a tab can
+            // begin left of it.
+            int right = E.coloff + E.screencols;
+            int cx = row_rx_to_cx(row, E.coloff);
+            int rx = row_cx_to_rx(row, cx);
+            HlReader hl;
+            hl.seek(row, cx);
+            MatchReader found;
+            found.seek(row, cx);
+            while (cx < len && rx < right) {
+                int match_end;
+                u8 match = found.at(cx, &match_end) ? FACE_MATCH : 0;
+                char ch = text[cx];
+
+                // Class of the byte at cx and where that class ends.
+                int kind_end;
+                u8 kind = hl.kind_at(cx, &kind_end);
+
+                if (ch == '\t') {
+                    int width = TAB_STOP - (rx % TAB_STOP);
+                    int from = std::max(rx, E.coloff);
+                    E.pen = kind | match;
+                    ewrite_cstr_with_len("        ", rx + width - from);
+                    rx += width;
+                    cx++;
+                    continue;
                 }
-                if (i == rowlen) break;
 
-                if (iscntrl(c[i])) {
-                    char sym = (c[i] <= 26) ? '@'+c[i] : '?';
-                    ewrite("\x1b[7m");
+                if (iscntrl(ch)) {
+                    char sym = (ch <= 26) ? '@'+ch : '?';
+                    E.pen = FACE_CONTROL | match;
                     ewrite_char(sym);
-                    ewrite("\x1b[m");
-                    if (current_color != -1) {
-                        ewrite(fmt::format("\x1b[{}m", current_color));
-                    }
-                } else if (hl[i] == HL_NORMAL) {
-                    if (current_color != -1) {
-                        ewrite("\x1b[39m");
-                        current_color = -1;
-                    }
-                    ewrite_cstr_with_len(&c[i], 1);
-                } else {
-                    int color = hl_to_color((EditorHighlight)hl[i]);
-                    if (color != current_color) {
-                        current_color = color;
-                        ewrite(fmt::format("\x1b[{}m", color));
-                    }
-                    ewrite_cstr_with_len(&c[i], 1);
+                    rx++;
+                    cx++;
+                    continue;
+                }
+
+                int end = cx+1;
+                int endrx = rx+1;
+                int stop = std::min(kind_end, match_end);
+                while (end < stop
+                       && endrx < right
+                       && text[end] != '\t'
+                       && !iscntrl(text[end])) {
+                    end++;
+                    endrx++;
                 }
+                E.pen = kind | match;
+                ewrite_cstr_with_len(&text[cx], end-cx);
+                rx = endrx;
+                cx = end;
             }
-            ewrite("\x1b[39m");
         }
 
-        ewrite("\x1b[K");
-        if (y < E.screenrows-1) {
-            ewrite("\r\n");
-        }
+        epen_reset();
+        eclear_eol();
+        enewline();
     }
 }
 
 void draw_status_bar() {
-    ewrite("\r\n");
-    if (E.mode == INSERT) {
-        ewrite("\x1b[1;47;30m");
-    } else {
-        ewrite("\x1b[1;44;30m");
-    }
-
-    std::string lstatus = fmt::format(
+    E.pen = (E.mode == INSERT) ? FACE_STATUS_INSERT : FACE_STATUS_NORMAL;
+
+    // Formatted into fixed buffers so that drawing a frame does not
+    // touch the heap.
+    char lstatus[64];
+    int llen = fmt::format_to_n(
+            lstatus,
+            sizeof(lstatus),
             "[{}{}] {:.20}",
             E.dirty ? '*' : '-',
             E.mode == INSERT ? 'I' : 'N',
-            E.path != "" ? E.path : "[No name]");
-    int llen = lstatus.size();
+            E.path != "" ? std::string_view(E.path) : "[No name]").size;
+    if (llen > (int)sizeof(lstatus)) llen = sizeof(lstatus);
     if (llen > E.screencols) llen = E.screencols;
 
-    std::string rstatus = fmt::format(
+    char rstatus[96];
+    usize rlen = fmt::format_to_n(
+        rstatus,
+        sizeof(rstatus),
         "{} {}/{}",
         E.syn ? E.syn->filetype : "none",
         E.cy+1,
-        E.numrows());
-    int rlen = rstatus.size();
+        E.numrows()).size;
+    if (E.loader.active && rlen < sizeof(rstatus)) {
+        rlen += fmt::format_to_n(
+            rstatus + rlen,
+            sizeof(rstatus) - rlen,
+            "+ [loading {}%]",
+            E.loader.progress(&E.file)).size;
+    }
+    if (rlen > sizeof(rstatus)) rlen = sizeof(rstatus);
 
-    ewrite_with_len(lstatus, llen);
+    ewrite_cstr_with_len(lstatus, llen);
     while (llen < E.screencols) {
-        if (E.screencols-llen == rlen) {
-            ewrite_with_len(rstatus, rlen);
+        if (E.screencols-llen == (int)rlen) {
+            ewrite_cstr_with_len(rstatus, rlen);
             break;
         } else {
             ewrite(" ");
@@ -1442,12 +5197,13 @@ void draw_status_bar() {
         }
     }
 
-    ewrite("\x1b[m");
+    epen_reset();
+    eclear_eol();
+    enewline();
 }
 
 void draw_cmdline() {
-    ewrite("\r\n");
-    ewrite("\x1b[K");
+    epen_reset();
     if (E.mode == COMMAND || E.mode == SEARCH) {
         if (E.mode == COMMAND) ewrite(":");
         else if (E.mode == SEARCH) ewrite("/");
@@ -1455,23 +5211,28 @@ void draw_cmdline() {
         if (len > (E.screencols-1)) len = (E.screencols-1);
         ewrite_cstr_with_len(&E.cmdline.data()[E.cmdoff], len);
     } else {
-        if (E.cmdline_style == ERROR) ewrite("\x1b[41;37m");
+        if (E.cmdline_style == ERROR) E.pen = FACE_ERROR;
         int len = E.cmdline_len();
         if (len > E.screencols) len = E.screencols;
         if (len/* && time(NULL)-E.cmdline_msg_time < 2*/) {
             ewrite_with_len(E.cmdline, len);
         }
-        if (E.cmdline_style == ERROR) ewrite("\x1b[0m");
+        epen_reset();
 
-        E.cmdline = "";
+        E.cmdline.clear();
         E.cmdline_style = NONE;
     }
+    eclear_eol();
+    enewline();
 }
 
 void draw_debug_info() {
-    ewrite("\r\n");
-    std::string debug_info = fmt::format(
-        "cmdx: {}, cmdoff: {}, len(cmd): {}, rows: {}, cx = {}, cy: {}, cx (calc): {}, rx: {}, tx: {}",
+    epen_reset();
+    char debug_info[256];
+    usize len = fmt::format_to_n(
+        debug_info,
+        sizeof(debug_info),
+        "cmdx: {}, cmdoff: {}, len(cmd): {}, rows: {}, cx = {}, cy: {}, cx (calc): {}, rx: {}, tx: {}, out: {}B, allocs: {}",
         E.cmdx,
         E.cmdoff,
         E.cmdline.size(),
@@ -1480,51 +5241,231 @@ void draw_debug_info() {
         E.cy,
         row_rx_to_cx(E.get_row_at(E.cy), E.rx),
         E.rx,
-        E.tx);
-    int len = debug_info.size();
-    if (len > E.screencols) len = E.screencols;
-    ewrite_with_len(debug_info, len);
-    ewrite("\x1b[K");
+        E.tx,
+        E.frame_bytes,
+        E.frame_allocs).size;
+    if (len > sizeof(debug_info)) len = sizeof(debug_info);
+    if (len > (usize)E.screencols) len = E.screencols;
+    ewrite_cstr_with_len(debug_info, len);
+    eclear_eol();
+}
+
+void emit_cursor_to(int y, int x) {
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y+1, x+1);
+    E.abuf.append(buf, len);
+}
+
+void emit_face(u8 face) {
+    const SgrCode& code = SGR_TABLE.codes[face];
+    E.abuf.append(code.seq, code.len);
+}
+
+// Appends cells [start, end) of row y of E.frame, switching faces as
+// needed. `face` tracks the terminal's current face.
+void emit_cells(int y, int start, int end, u8* face) {
+    const char* chars = E.frame.chars_at(y);
+    const u8* faces = E.frame.faces_at(y);
+    int i = start;
+    while (i < end) {
+        int run = i+1;
+        while (run < end && faces[run] == faces[i]) run++;
+        if (faces[i] != *face) {
+            *face = faces[i];
+            emit_face(*face);
+        }
+        E.abuf.append(&chars[i], run-i);
+        i = run;
+    }
+}
+
+// Clears from the terminal cursor to the end of its row, in the default
+// face.
+void emit_clear_eol(u8* face) {
+    if (*face != HL_NORMAL) {
+        *face = HL_NORMAL;
+        E.abuf += "\x1b[m";
+    }
+    E.abuf += "\x1b[K";
+}
+
+bool row_has_wide_bytes(Frame& frame, int y) {
+    const char* chars = frame.chars_at(y);
+    for (int x = 0; x < frame.cols; x++) {
+        if ((u8)chars[x] >= 0x80) return true;
+    }
+    return false;
+}
+
+// Index one past the last cell of row y that is not a default blank.
+int row_content_end(Frame& frame, int y) {
+    const char* chars = frame.chars_at(y);
+    const u8* faces = frame.faces_at(y);
+    int end = frame.cols;
+    while (end > 0 && chars[end-1] == ' ' && faces[end-1] == HL_NORMAL) end--;
+    return end;
+}
+
+// Number of text rows whose new content equals the old row `shift`
+// rows further down.
+int text_rows_matching(int shift) {
+    int count = 0;
+    for (int y = 0; y < E.screenrows; y++) {
+        int oy = y + shift;
+        if (oy < 0 || oy >= E.screenrows) continue;
+        if (E.frame.row_equals(y, E.lastframe, oy)) count++;
+    }
+    return count;
+}
+
+// If rowoff moved by less than a screenful since the last frame, scrolls
+// the text area on the terminal (DECSTBM plus SU/SD) and in E.lastframe,
+// so the diff only has the newly exposed rows left to paint.
+void scroll_text_area() {
+    int shift = E.rowoff - E.lastframe_rowoff;
+    int rows = E.screenrows;
+    if (shift == 0 || abs(shift) >= rows) return;
+    if (text_rows_matching(shift) <= text_rows_matching(0)) return;
+
+    char* chars = E.lastframe.chars_at(0);
+    u8* faces = E.lastframe.faces_at(0);
+    usize n = (usize)abs(shift) * E.lastframe.cols;
+    usize total = (usize)rows * E.lastframe.cols;
+    if (shift > 0) {
+        memmove(chars, chars + n, total - n);
+        memmove(faces, faces + n, total - n);
+        memset(chars + total - n, ' ', n);
+        memset(faces + total - n, HL_NORMAL, n);
+    } else {
+        memmove(chars + n, chars, total - n);
+        memmove(faces + n, faces, total - n);
+        memset(chars, ' ', n);
+        memset(faces, HL_NORMAL, n);
+    }
+
+    char buf[48];
+    int len = snprintf(
+        buf,
+        sizeof(buf),
+        "\x1b[1;%dr\x1b[%d%c\x1b[r",
+        rows,
+        abs(shift),
+        shift > 0 ? 'S' : 'T');
+    E.abuf.append(buf, len);
+}
+
+// Unchanged gaps shorter than this between two changed runs are sent
+// anyway; that is cheaper than another cursor move.
+const int DAMAGE_MERGE_GAP = 6;
+
+// Sends the terminal the difference between E.frame and what it showed
+// after the last call, then leaves the cursor at (cy, cx).
+void flush_frame(int cy, int cx) {
+    Frame& cur = E.frame;
+    Frame& old = E.lastframe;
+    int cols = cur.cols;
+
+    E.abuf.clear();
+    E.abuf += "\x1b[?25l";
+    if (!E.lastframe_valid) {
+        E.abuf += "\x1b[m\x1b[2J";
+        old.resize(cur.rows, cur.cols);
+    } else {
+        scroll_text_area();
+    }
+
+    u8 face = HL_NORMAL;
+    int tx = -1, ty = -1;
+    for (int y = 0; y < cur.rows; y++) {
+        if (cur.row_equals(y, old, y)) continue;
+
+        int nend = row_content_end(cur, y);
+        int oend = row_content_end(old, y);
+
+        // A byte of a multibyte character does not take a column of its
+        // own, so such rows are redrawn from the left edge when anything
+        // in them changes.
+        if (row_has_wide_bytes(cur, y) || row_has_wide_bytes(old, y)) {
+            emit_cursor_to(y, 0);
+            emit_cells(y, 0, nend, &face);
+            emit_clear_eol(&face);
+            ty = -1;
+            continue;
+        }
+
+        const char* nchars = cur.chars_at(y);
+        const u8* nfaces = cur.faces_at(y);
+        const char* ochars = old.chars_at(y);
+        const u8* ofaces = old.faces_at(y);
+        auto changed = [&](int x) {
+            return nchars[x] != ochars[x] || nfaces[x] != ofaces[x];
+        };
+
+        int x = 0;
+        while (x < cols) {
+            if (!changed(x)) {
+                x++;
+                continue;
+            }
+
+            int start = x;
+            int last = x;
+            for (x++; x < cols && x - last <= DAMAGE_MERGE_GAP; x++) {
+                if (changed(x)) last = x;
+            }
+            int end = last+1;
+            bool clear = false;
+            if (end >= nend) {
+                // Everything from here to the right edge is blank in the
+                // new frame; send the content and clear the rest.
+                clear = oend > std::max(start, nend);
+                end = std::max(start, nend);
+                x = cols;
+            } else {
+                x = end;
+            }
+
+            if (ty != y || tx != start) emit_cursor_to(y, start);
+            emit_cells(y, start, end, &face);
+            if (clear) emit_clear_eol(&face);
+            ty = y;
+            tx = end;
+        }
+    }
+
+    if (face != HL_NORMAL) E.abuf += "\x1b[m";
+    emit_cursor_to(cy, cx);
+    E.abuf += "\x1b[?25h";
+
+    E.frame_bytes = E.abuf.size();
+    write(STDOUT_FILENO, E.abuf.data(), E.abuf.size());
+    std::swap(E.frame, E.lastframe);
+    E.lastframe_valid = true;
+    E.lastframe_rowoff = E.rowoff;
 }
 
 void refresh_screen() {
+    u64 allocs = heap_allocs;
     if (E.mode != COMMAND && E.mode != SEARCH) {
         update_rx();
         scroll_to(E.rx, E.cy);
     }
     scroll_cmdline();
 
-    E.abuf.clear();
-    ewrite("\x1b[?25l");
-    ewrite("\x1b[H");
-
+    E.pen_y = 0;
+    E.pen_x = 0;
     draw_rows();
     draw_status_bar();
     draw_cmdline();
     draw_debug_info();
 
-    char buf[32];
-    usize len;
     if (E.mode == COMMAND || E.mode == SEARCH) {
-        len = snprintf(
-            buf,
-            sizeof(buf)-1,
-            "\x1b[%d;%dH",
-            // +2 makes it go from last row to cmdline
-            E.screenrows+2,
-            (E.cmdx-E.cmdoff)+2);
+        // +1 makes it go from last row to cmdline
+        flush_frame(E.screenrows+1, (E.cmdx-E.cmdoff)+1);
     } else {
-        len = snprintf(
-            buf,
-            sizeof(buf)-1,
-            "\x1b[%d;%dH",
-            (E.cy-E.rowoff)+1,
-            (E.rx-E.coloff)+1);
+        flush_frame(E.cy-E.rowoff, E.rx-E.coloff);
     }
-    ewrite(std::string(buf, 0, len));
-    ewrite("\x1b[?25h");
-
-    write(STDOUT_FILENO, E.abuf.data(), E.abuf.size());
+    E.frame_allocs = heap_allocs - allocs;
 }
 
 void init_editor() {
@@ -1537,14 +5478,41 @@ void init_editor() {
     E.rowoff = 0;
     E.coloff = 0;
     E.mode = NORMAL;
+    E.count = 0;
+    E.search_icase = false;
+    E.search_regex = false;
+    E.text_gen = 1;
+    E.matches.text_gen = 0;
+    E.isearch.active = false;
+    E.isearch.partial = false;
     E.dirty = false;
     E.cmdx = 0;
     E.cmdoff = 0;
     E.syn = NULL;
-    E.reset_hlt();
+    E.hl_gen = 1;
+    E.syn_frontier = 0;
+    E.file.data = "";
+    E.file.size = 0;
+    E.file.mapped = false;
+    E.rows.root = NULL;
+    E.rows.file = &E.file;
+    row_pool.init(sizeof(EditorRow), alignof(EditorRow));
+    node_pool.init(sizeof(RowNode), alignof(RowNode));
+    hl_arena.init();
+    tab_arena.init();
+    E.loader.active = false;
+    E.search_hl.on = false;
+    E.search_hl.gen = 1;
+    E.undo.init();
     if (get_window_size(&E.screenrows, &E.screencols) == -1)
         core::error_exit_from("get_window_size");
     E.abuf.reserve(5*1024);
+    E.frame.resize(E.screenrows+3, E.screencols);
+    E.lastframe.resize(E.screenrows+3, E.screencols);
+    E.lastframe_valid = false;
+    E.lastframe_rowoff = 0;
+    E.frame_bytes = 0;
+    E.frame_allocs = 0;
     E.cmdline_msg_time = 0;
     E.quit_times = NUM_FORCE_QUIT_PRESS;
     E.skip_after_action = false;
@@ -1562,6 +5530,13 @@ int main(int argc, char** argv) {
     set_cmdline_msg_info("HELP: Alt-s save, ` quit");
 
     while (1) {
+        // A running search reads the line index, so it has to end
+        // before newly loaded lines go in.
+        if (!E.isearch.active) {
+            E.loader.absorb(&E.file, &E.rows);
+            resume_incremental_search();
+        }
+        absorb_incremental_search();
         refresh_screen();
         process_keypress();
     }